@@ -0,0 +1,397 @@
+// Allocator benchmarks, run against whatever malloc() the process ends up with.
+// Every run prints one JSON object per line: throughput, p99 latency and peak RSS.
+//
+// Usage: bench <label> sizes | prodcons [threads] | larson [threads] | realloc | replay <trace>
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define ITERATIONS 200000
+#define BATCH 100 // Objects allocated before they are freed again, so that free() does real work
+#define RING 1024 // Slots between a producer and its consumer
+#define LARSON_SLOTS 1000
+#define LARSON_MAX 1000
+#define MAX_THREADS 64
+#define SAMPLE 16 // Threads time every SAMPLE-th iteration, reading the clock around every call would be most of the work
+#define SAMPLES (3 * ITERATIONS / SAMPLE + 3) // Larson times three calls per iteration
+
+typedef struct result_t result_t;
+
+struct result_t {
+	const char *bench;
+	size_t size; // 0 when the bench mixes sizes
+	size_t threads;
+	size_t ops;
+	double seconds;
+	uint64_t *latencies; // Sampled nanoseconds per operation, NULL when not measured
+	size_t nlatencies;
+};
+
+// A producer hands objects to its consumer through a ring, which frees them on another thread
+typedef struct ring_t ring_t;
+
+struct ring_t {
+	void *slots[RING];
+	size_t head __attribute__((aligned(64)));
+	size_t tail __attribute__((aligned(64)));
+};
+
+static const char *label;
+static size_t nthreads = 4;
+static ring_t rings[MAX_THREADS];
+static void *larson_slots[MAX_THREADS][LARSON_SLOTS];
+static uint64_t thread_latencies[2 * MAX_THREADS][SAMPLES]; // A row for every thread, merged once they are joined
+static size_t thread_nlatencies[2 * MAX_THREADS];
+
+static uint64_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare(const void *a, const void *b) {
+	uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void report(result_t *result) {
+	uint64_t p99 = 0;
+	if (result->nlatencies) {
+		qsort(result->latencies, result->nlatencies, sizeof(uint64_t), compare);
+		p99 = result->latencies[result->nlatencies * 99 / 100];
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("{\"allocator\": \"%s\", \"bench\": \"%s\", \"size\": %zu, \"threads\": %zu, \"ops\": %zu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, \"p99_ns\": %llu, \"peak_rss_kb\": %ld}\n",
+		label, result->bench, result->size, result->threads, result->ops, result->seconds,
+		result->ops / result->seconds, (unsigned long long)p99, usage.ru_maxrss);
+	fflush(stdout);
+}
+
+// Pack the rows of the first threads next to each other, report() sorts them together
+static void gather(result_t *result, size_t threads) {
+	uint64_t *latencies = thread_latencies[0];
+	result->nlatencies = 0;
+	for (size_t i = 0; i < threads; i++) {
+		memmove(latencies + result->nlatencies, thread_latencies[i], thread_nlatencies[i] * sizeof(uint64_t));
+		result->nlatencies += thread_nlatencies[i];
+	}
+	result->latencies = latencies;
+}
+
+// Single thread malloc() and free() by size class.
+// The first pass measures throughput, the second times every call on its own.
+static void bench_sizes() {
+	static const size_t sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 4096, 16384, 65536, 262144 };
+	static void *objects[BATCH];
+	static uint64_t latencies[2 * ITERATIONS];
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t size = sizes[s];
+		size_t iterations = size > 16384 ? ITERATIONS / 20 : ITERATIONS;
+		result_t result = { .bench = "sizes", .size = size, .threads = 1, .ops = 2 * iterations };
+
+		uint64_t start = now();
+		for (size_t i = 0; i < iterations; i += BATCH) {
+			for (size_t j = 0; j < BATCH; j++) *(char *)(objects[j] = malloc(size)) = 1;
+			for (size_t j = 0; j < BATCH; j++) free(objects[j]);
+		}
+		result.seconds = (now() - start) / 1e9;
+
+		for (size_t i = 0; i < iterations; i += BATCH) {
+			for (size_t j = 0; j < BATCH; j++) {
+				uint64_t t = now();
+				objects[j] = malloc(size);
+				latencies[result.nlatencies++] = now() - t;
+				*(char *)objects[j] = 1;
+			}
+			for (size_t j = 0; j < BATCH; j++) {
+				uint64_t t = now();
+				free(objects[j]);
+				latencies[result.nlatencies++] = now() - t;
+			}
+		}
+		result.latencies = latencies;
+		report(&result);
+	}
+}
+
+static void *producer(void *arg) {
+	ring_t *ring = arg;
+	unsigned seed = ring - rings;
+	uint64_t *latencies = thread_latencies[2 * (ring - rings)];
+	size_t n = 0;
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		uint64_t t = i % SAMPLE == 0 ? now() : 0;
+		void *ptr = malloc(16 + rand_r(&seed) % 512);
+		if (t) latencies[n++] = now() - t;
+		*(char *)ptr = 1;
+		size_t head = ring->head;
+		while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING) sched_yield();
+		ring->slots[head % RING] = ptr;
+		__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	}
+	thread_nlatencies[2 * (ring - rings)] = n;
+	return NULL;
+}
+
+static void *consumer(void *arg) {
+	ring_t *ring = arg;
+	uint64_t *latencies = thread_latencies[2 * (ring - rings) + 1];
+	size_t n = 0;
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		size_t tail = ring->tail;
+		while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) sched_yield();
+		uint64_t t = i % SAMPLE == 0 ? now() : 0;
+		free(ring->slots[tail % RING]);
+		if (t) latencies[n++] = now() - t;
+		__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+	thread_nlatencies[2 * (ring - rings) + 1] = n;
+	return NULL;
+}
+
+// Pairs of threads, every object is freed by a thread other than the one that allocated it
+static void bench_prodcons() {
+	pthread_t threads[2 * MAX_THREADS];
+	result_t result = { .bench = "prodcons", .threads = 2 * nthreads, .ops = 2 * ITERATIONS * nthreads };
+
+	uint64_t start = now();
+	for (size_t i = 0; i < nthreads; i++) {
+		pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+		pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+	}
+	for (size_t i = 0; i < 2 * nthreads; i++) pthread_join(threads[i], NULL);
+	result.seconds = (now() - start) / 1e9;
+	gather(&result, 2 * nthreads);
+	report(&result);
+}
+
+// Larson: every thread replaces random objects of its own with new ones of random size,
+// and now and then frees an object of its neighbour instead, which is how server threads hand work around
+static void *larson(void *arg) {
+	size_t self = (uintptr_t)arg;
+	unsigned seed = self;
+	void **slots = larson_slots[self];
+	void **neighbour = larson_slots[(self + 1) % nthreads];
+	uint64_t *latencies = thread_latencies[self];
+	size_t n = 0;
+	for (size_t i = 0; i < LARSON_SLOTS; i++) slots[i] = malloc(16 + rand_r(&seed) % LARSON_MAX);
+
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		size_t slot = rand_r(&seed) % LARSON_SLOTS;
+		void **victim = i % 64 == 0 ? &neighbour[slot] : &slots[slot];
+		size_t size = 16 + rand_r(&seed) % LARSON_MAX;
+		void *old = __atomic_exchange_n(victim, NULL, __ATOMIC_ACQ_REL);
+		if (i % SAMPLE) {
+			free(old);
+			void *ptr = malloc(size);
+			*(char *)ptr = 1;
+			free(__atomic_exchange_n(&slots[slot], ptr, __ATOMIC_ACQ_REL));
+			continue;
+		}
+		uint64_t t = now();
+		free(old);
+		latencies[n++] = now() - t;
+		t = now();
+		void *ptr = malloc(size);
+		latencies[n++] = now() - t;
+		*(char *)ptr = 1;
+		old = __atomic_exchange_n(&slots[slot], ptr, __ATOMIC_ACQ_REL);
+		t = now();
+		free(old);
+		latencies[n++] = now() - t;
+	}
+	thread_nlatencies[self] = n;
+	return NULL;
+}
+
+static void bench_larson() {
+	pthread_t threads[MAX_THREADS];
+	result_t result = { .bench = "larson", .threads = nthreads, .ops = 2 * ITERATIONS * nthreads };
+
+	uint64_t start = now();
+	for (size_t i = 0; i < nthreads; i++) pthread_create(&threads[i], NULL, larson, (void *)i);
+	for (size_t i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+	result.seconds = (now() - start) / 1e9;
+	for (size_t i = 0; i < nthreads; i++) {
+		for (size_t j = 0; j < LARSON_SLOTS; j++) free(larson_slots[i][j]);
+	}
+	gather(&result, nthreads);
+	report(&result);
+}
+
+// Buffers grown by half again at every step up to 1 MiB, a few at a time so that they get in each other's way
+static void bench_realloc() {
+	static uint64_t latencies[ITERATIONS];
+	result_t result = { .bench = "realloc", .threads = 1 };
+
+	uint64_t start = now();
+	while (result.nlatencies < ITERATIONS - 8 * 64) {
+		void *buffers[8] = { NULL };
+		size_t sizes[8];
+		for (size_t i = 0; i < 8; i++) sizes[i] = 16 + i * 8;
+		for (bool growing = true; growing;) {
+			growing = false;
+			for (size_t i = 0; i < 8; i++) {
+				if (sizes[i] > (1 << 20)) continue;
+				uint64_t t = now();
+				buffers[i] = realloc(buffers[i], sizes[i]);
+				latencies[result.nlatencies++] = now() - t;
+				((char *)buffers[i])[sizes[i] - 1] = 1;
+				sizes[i] += sizes[i] / 2;
+				growing = true;
+			}
+		}
+		for (size_t i = 0; i < 8; i++) free(buffers[i]);
+	}
+	result.seconds = (now() - start) / 1e9;
+	result.ops = result.nlatencies;
+	result.latencies = latencies;
+	report(&result);
+}
+
+// Replay a trace written with QALLOC_CONF=trace:1 on a single thread.
+// The pointers of the trace are mapped to the ones handed out now through an open addressing table.
+typedef struct entry_t entry_t;
+
+struct entry_t {
+	uintptr_t traced;
+	void *ptr;
+};
+
+static entry_t *table;
+static size_t table_mask;
+
+static entry_t *lookup(uintptr_t traced) {
+	size_t i = (traced * 0x9e3779b97f4a7c15ULL >> 20) & table_mask;
+	while (table[i].traced && table[i].traced != traced) i = (i + 1) & table_mask;
+	return &table[i];
+}
+
+// Removal shifts the entries after it back, so that lookups never need tombstones
+static void forget(entry_t *entry) {
+	size_t hole = entry - table;
+	for (size_t i = (hole + 1) & table_mask; table[i].traced; i = (i + 1) & table_mask) {
+		size_t home = (table[i].traced * 0x9e3779b97f4a7c15ULL >> 20) & table_mask;
+		if (((i - home) & table_mask) >= ((i - hole) & table_mask)) {
+			table[hole] = table[i];
+			hole = i;
+		}
+	}
+	table[hole].traced = 0;
+	table[hole].ptr = NULL;
+}
+
+static void bench_replay(const char *path) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	char *trace = mmap(NULL, st.st_size + 1, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (trace == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	size_t lines = 0;
+	for (off_t i = 0; i < st.st_size; i++) lines += trace[i] == '\n';
+	size_t slots = 16;
+	while (slots < 2 * lines) slots <<= 1;
+	table = calloc(slots, sizeof(entry_t));
+	table_mask = slots - 1;
+	uint64_t *latencies = malloc(lines * sizeof(uint64_t));
+	result_t result = { .bench = "replay", .threads = 1 };
+
+	uint64_t start = now();
+	for (char *line = trace, *end = trace + st.st_size; line < end;) {
+		char op = *line;
+		char *next = line + 1;
+		unsigned long long a = 0, b = 0, c = 0;
+		a = strtoull(next, &next, op == 'f' || op == 'r' ? 16 : 10);
+		if (op != 'f') b = strtoull(next, &next, op == 'c' || op == 'm' ? 16 : 10);
+		if (op == 'a' || op == 'r') c = strtoull(next, &next, 16);
+		line = memchr(next, '\n', end - next);
+		line = line ? line + 1 : end;
+
+		uint64_t t = now();
+		void *ptr = NULL;
+		entry_t *entry;
+		switch (op) {
+		case 'm':
+			ptr = malloc(a);
+			break;
+		case 'c':
+			ptr = calloc(1, a);
+			break;
+		case 'a':
+			ptr = aligned_alloc(a, (b + a - 1) & ~(a - 1));
+			b = c;
+			break;
+		case 'r':
+			entry = a ? lookup(a) : NULL;
+			if (a && !entry->traced) continue; // The allocation happened before tracing started
+			ptr = realloc(entry ? entry->ptr : NULL, b);
+			if (entry) forget(entry);
+			b = c;
+			break;
+		case 'f':
+			entry = lookup(a);
+			if (!entry->traced) continue;
+			free(entry->ptr);
+			forget(entry);
+			break;
+		default:
+			continue;
+		}
+		latencies[result.nlatencies++] = now() - t;
+		if (ptr && b) {
+			entry = lookup(b);
+			if (entry->traced) free(entry->ptr); // A free the trace did not see, from before it started
+			entry->traced = b;
+			entry->ptr = ptr;
+		}
+	}
+	result.seconds = (now() - start) / 1e9;
+	result.ops = result.nlatencies;
+	result.latencies = latencies;
+	report(&result);
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <label> sizes | prodcons [threads] | larson [threads] | realloc | replay <trace>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	label = argv[1];
+	const char *bench = argv[2];
+	if (argc > 3 && strcmp(bench, "replay") != 0) {
+		nthreads = strtoul(argv[3], NULL, 10);
+		if (nthreads < 1) nthreads = 1;
+		if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+	}
+
+	if (strcmp(bench, "sizes") == 0) bench_sizes();
+	else if (strcmp(bench, "prodcons") == 0) bench_prodcons();
+	else if (strcmp(bench, "larson") == 0) bench_larson();
+	else if (strcmp(bench, "realloc") == 0) bench_realloc();
+	else if (strcmp(bench, "replay") == 0 && argc > 3) bench_replay(argv[3]);
+	else {
+		fprintf(stderr, "unknown bench: %s\n", bench);
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
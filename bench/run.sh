@@ -0,0 +1,23 @@
+#!/bin/sh
+# Run every bench against glibc and against the library given, one process per bench so that peak RSS is its own.
+# Traces named on the command line are replayed as well.
+#
+# Usage: bench/run.sh <qalloc.so> [trace...]
+set -e
+dir=$(dirname "$0")
+lib=$(realpath "$1")
+shift
+threads=${THREADS:-4}
+
+run() {
+	"$dir/bench" glibc "$@"
+	LD_PRELOAD="$lib" "$dir/bench" qalloc "$@"
+}
+
+run sizes
+run prodcons "$threads"
+run larson "$threads"
+run realloc
+for trace in "$@"; do
+	run replay "$trace"
+done
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <sys/mman.h>
 #include <stdint.h>
@@ -9,228 +10,2667 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <assert.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/auxv.h>
+#include <time.h>
+// Release builds hide everything, only the allocator interface stays visible
+#pragma GCC visibility push(default)
+#include "qalloc.h"
+#pragma GCC visibility pop
 
 #define INITIAL_SIZE 256 // This is the initial size in pages
 #define EXTEND_MIN 16 // This is the minimum sbrk() increment size in pages
 #define ALIGNMENT 16 // The byte alignment returned by a call to malloc
+#define NSMALLBINS 64 // Exact-size bins, one for every multiple of ALIGNMENT
+#define NLARGEBINS 64 // Log-spaced bins, 4 for every power of two
+#define NBINS (NSMALLBINS + NLARGEBINS)
+#define MAX_SMALL (NSMALLBINS * ALIGNMENT) // The largest size kept in an exact-size bin
+#define INUSE 1 // The chunk is handed out, or cached by a thread
+#define PREV_INUSE 2 // The chunk before is in use, so prev_size does not hold its size
+#define MMAPPED 4 // Not part of any heap, the chunk starts its own mapping
+#define REGION 8 // A mapped chunk that belongs to a region, free() leaves it alone
+#define GUARDED PREV_INUSE // A mapped chunk that ends at a guard page, mapped chunks have no chunk before
+#define FLAGS (INUSE | PREV_INUSE | MMAPPED | REGION) // Chunk sizes are multiples of ALIGNMENT, which leaves the low bits free
+#define COOKIE_SHIFT 48 // With checks on, the bits above hold a cookie while the chunk is handed out
+#define SIZE_MASK (((1ULL << COOKIE_SHIFT) - 1) & ~(size_t)FLAGS)
+#define OVERHEAD sizeof(size_t) // What a chunk in use costs on top of its payload
+#define MIN_CHUNK (sizeof(chunk_t) + sizeof(links_t)) // Enough for the bin links and the footer once freed
+#define FREE_HEADER (sizeof(chunk_t) + sizeof(tree_t)) // What binning may write at the start of a free chunk
+#define TCACHE_COUNT 128 // The most chunks a thread caches per size class, half of them are spilled when full
+#define TCACHE_START 8 // What a class may hold at first, it adapts to the churn from there
+#define TCACHE_GC 8192 // Cache operations of a thread between two passes that resize its classes
+#define TCACHE_MAX 4096 // The most QALLOC_CONF can ask for
+#define MAX_ARENAS 64
+#define PROF_SLOTS (1 << 14) // Live samples the profiler can hold, a power of two
+#define PROF_LINE 8 // Slots probed for a pointer, one cache line of them
+#define PROF_DEPTH 30 // Frames kept per sample
+#define MAX_NODES 64 // NUMA nodes past this share arenas with the lower ones
+#define ARENAS_PER_CPU 2
+#define SEGMENT_SIZE (64UL << 20) // Address space reserved by each mmap() backed heap segment, a power of two
+#define SEGMENT_HEADER ((sizeof(segment_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#define SLAB_MAX 256 // Allocations up to this size are served from slabs, every multiple of ALIGNMENT is a class
+#define NSLABCLASSES (SLAB_MAX / ALIGNMENT)
+#define SLAB_SPACE (1UL << 30) // Address space reserved for slab pages
+#define SLAB_COMMIT 64 // This is the number of slab pages made accessible at a time
+#define REGION_SPACE (1UL << 30) // Address space reserved for the blocks of regions
+#define REGION_BLOCK (64UL << 10)
+#define REGION_LARGE (REGION_BLOCK / 4) // Larger objects of a region get a mapping of their own
+#define LOCK_SPIN 64 // The longest run of pause instructions before a lock sleeps in the kernel
+#define HUGE_PAGE (2UL << 20) // The size of a transparent huge page on x86-64 and arm64
+#define MMAP_THRESHOLD (128 * 1024) // The default size from which allocations get a mapping of their own
+#define TRIM_THRESHOLD (128 * 1024) // The default amount of free space at the top of a heap that gets trimmed
+#define TRIM_THRESHOLD_MAX (64UL << 20) // The most a trim followed by regrowth raises the threshold to
+#define TOP_PAD (128 * 1024) // The default free space kept at the top of a heap when it grows or is trimmed
+#define QUARANTINE (64UL << 20) // The default address space that freed guarded allocations hold on to
+#define QUARANTINE_SLOTS 4096 // The most guarded allocations held at a time
+#define BOOT_HEAP (64 * 1024) // Serves what init() allocates, directly or through the libraries it calls
 
+// The header of a chunk is just its size and flags. A free chunk also keeps its size as a footer,
+// in the prev_size word of the chunk after it, which lets free() coalesce to the left.
+// While the chunk before is in use, prev_size is the tail of its payload.
+// The size of a chunk counts everything from prev_size up to the next chunk's prev_size.
 typedef struct chunk_t chunk_t;
 
 struct chunk_t {
+	size_t prev_size;
+	size_t head;
+};
+
+// A piece of an arena's heap obtained with mmap(), aligned to SEGMENT_SIZE so that
+// every chunk inside can find it by masking its own address.
+// The reservation is PROT_NONE above top and made accessible as the segment grows.
+typedef struct arena_t arena_t;
+typedef struct segment_t segment_t;
+
+struct segment_t {
+	arena_t *arena;
+	segment_t *next;
+	void *top;
+	void *end;
+};
+
+// A page carved into equally sized objects, without any per-object header.
+// The header sits at the start of the page, so an object finds it by rounding its address down.
+typedef struct slab_t slab_t;
+
+struct slab_t {
+	arena_t *arena;
+	slab_t *next; // The arena's slabs of this class with free slots
+	slab_t *prev;
+	uint32_t size;
+	uint16_t nslots;
+	uint16_t nfree;
+	uint64_t bitmap[]; // A set bit marks a free slot
+};
+
+// Free chunks are linked into their bin through the payload
+typedef struct links_t links_t;
+
+struct links_t {
+	chunk_t *fd;
+	chunk_t *bk;
+};
+
+// Chunks in a log-spaced bin are also nodes of a treap ordered by size, then address.
+// The priority is a hash of the address, so the shape needs no state of its own.
+typedef struct tree_t tree_t;
+
+struct tree_t {
+	links_t links;
+	chunk_t *left;
+	chunk_t *right;
+	size_t binned; // The pass of the background thread it was binned in, 0 once its pages were given back
+};
+
+// How heaps are backed, chosen with QALLOC_HUGEPAGES=thp or QALLOC_HUGEPAGES=hugetlb
+enum {
+	HUGEPAGES_OFF,
+	HUGEPAGES_THP, // Grow in huge page steps and madvise(MADV_HUGEPAGE) everything
+	HUGEPAGES_HUGETLB, // Back segments with MAP_HUGETLB as well, and never hand their pages back
+};
+
+// Recently freed small chunks, cached per thread and handed out again without locking.
+// Cached chunks stay marked as in use, as far as the heap is concerned they were never freed.
+typedef struct tcache_t tcache_t;
+
+enum {
+	TCACHE_UNINIT,
+	TCACHE_ACTIVE,
+	TCACHE_DISABLED, // While being set up and after the thread has drained it on exit
+};
+
+struct tcache_t {
+	void *entries[NSMALLBINS]; // Linked through the first word of the payload
+	uint16_t counts[NSMALLBINS];
+	uint16_t limits[NSMALLBINS]; // What each class may hold, up to conf.tcache_count
+	uint16_t low[NSMALLBINS]; // The fewest each class held since the last pass
+	uint16_t misses[NSMALLBINS]; // Allocations since the last pass that found the class empty
+	uint32_t ticks; // Operations left before the next pass, other threads set it to 1 to have one soon
+	uint32_t seen; // ticks when the cache was last looked at by tcache_scavenge()
+	bool flush; // Set by other threads, the next pass gives back everything the cache holds
+	int state;
+	size_t hits[NSMALLBINS]; // Allocations served from the cache
+	size_t puts; // Frees kept in the cache
+	tcache_t *next; // Every active cache is listed, so statistics can add them up
+	tcache_t *prev;
+};
+
+// A lock that spins briefly with exponential backoff, then sleeps on a futex.
+// Zero is unlocked, so a lock needs no setup and works before anything else is initialised.
+// It fills a cache line of its own, away from the data it guards.
+typedef struct lock_t lock_t;
+
+enum {
+	LOCK_FREE,
+	LOCK_HELD,
+	LOCK_WAITERS, // Held, and somebody may sleep on it
+};
+
+struct lock_t {
+	uint32_t word;
+} __attribute__((aligned(64)));
+
+// A region hands out memory by bumping a pointer through blocks and takes all of it back at once.
+// The region sits at the start of its first block, the blocks are linked through their first word.
+// Block objects have no headers, free() recognises them by their address.
+struct qalloc_region_t {
+	void *next; // The second block
+	void *last; // The block allocations currently come from
+	void *top;
+	void *end;
+	chunk_t *large; // Mapped chunks, linked through the word at the start of their mapping
+};
+
+// An allocation the profiler sampled, kept until it is freed
+typedef struct sample_t sample_t;
+
+struct sample_t {
 	size_t size;
-	chunk_t *next;
-	chunk_t *prev;
-	bool free;
+	size_t depth;
+	void *stack[PROF_DEPTH];
 };
 
-static chunk_t *first_chunk = NULL;
-static chunk_t *last_chunk = NULL;
-static size_t pagesize;
-static pthread_mutex_t mutex;
+// What the profiler writes goes through a buffer on the stack, the signal handler cannot allocate
+typedef struct out_t out_t;
+
+struct out_t {
+	int fd;
+	size_t used;
+	char data[4096];
+};
+
+// Counters of an arena, updated under its lock
+typedef struct stats_t stats_t;
+
+struct stats_t {
+	size_t system; // Bytes of the sbrk() heap and segments
+	size_t system_max;
+	size_t free; // Bytes in binned free chunks
+	size_t nchunks; // Binned free chunks
+	size_t deferred; // Bytes in freed chunks that wait to be coalesced
+	size_t slab_pages; // Bytes of slab pages
+	size_t slab_used; // Bytes handed out from them
+	size_t mallocs[NBINS]; // Allocations served under the lock, by size class
+	size_t frees; // Pointers released into the arena
+	size_t remote; // Of those, the ones other threads freed through the remote list
+	size_t contended; // Times the lock was found held
+	size_t extends;
+	size_t trims;
+};
+
+// An independent heap with its own lock.
+// Threads allocate from the arena they were assigned, chunks are freed back into the arena they came from.
+// The main arena grows with sbrk(), the others (and the main one, should sbrk() fail) grow by segments.
+struct arena_t {
+	lock_t lock;
+	chunk_t *first_chunk; // The region currently grown: the sbrk() heap or the newest segment
+	chunk_t *last_chunk;
+	void *zero; // Past this the region is as the OS handed it out, but for the headers, links and footers of free chunks
+	segment_t *segments; // Newest first
+	chunk_t *bins[NBINS];
+	chunk_t *trees[NLARGEBINS]; // The root of the treap of every log-spaced bin
+	chunk_t *deferred[NSMALLBINS]; // Freed small chunks by size, still marked in use and linked through their payload
+	uint64_t binmap[NBINS / 64]; // A set bit marks a non-empty bin
+	slab_t *slabs[NSLABCLASSES];
+	void *remote; // Pointers freed by threads of other arenas, linked through their first word and pushed atomically
+	unsigned node; // The NUMA node its segments are placed on and its threads run on
+	size_t trimmed; // What the last trim of the top gave back, until the arena grows again
+	stats_t stats;
+};
+
+// Settings, defaults overridden by QALLOC_CONF and mallopt().
+// The ones the hot paths read come first and share a cache line.
+typedef struct conf_t conf_t;
+
+struct conf_t {
+	size_t mmap_threshold;
+	size_t tcache_count;
+	size_t defer; // Bytes of small chunks an arena collects on free() before coalescing them all, 0 coalesces every one
+	bool stats; // Count events, the sizes mallinfo2() reports are always kept
+	size_t prof_rate; // Mean bytes allocated between two samples of the heap profiler, 0 turns it off
+	size_t prof_signal; // Dump the profile on this signal as well as at exit
+	bool trace; // Log every call of the malloc interface for replay
+	bool check; // Verify chunk headers and catch double frees, abort() on what looks like corruption
+	size_t guard; // Put one allocation in this many against a guard page, 0 turns it off
+	size_t quarantine; // Bytes of freed guarded allocations kept inaccessible before the address space is reused
+	size_t trim_threshold;
+	size_t top_pad; // Free space added on top of a heap when it grows and left there when it is trimmed
+	size_t initial_size;
+	size_t extend_min;
+	size_t arenas; // 0 gives ARENAS_PER_CPU for every CPU
+	int hugepages;
+	bool numa; // Give every node arenas of its own, grown by segments placed on that node
+	size_t background; // Milliseconds between the passes of a thread that returns free memory, 0 does it inline
+};
+
+static conf_t conf __attribute__((aligned(64))) = {
+	.mmap_threshold = MMAP_THRESHOLD,
+	.tcache_count = TCACHE_COUNT,
+	.stats = true,
+	.trim_threshold = TRIM_THRESHOLD,
+	.top_pad = TOP_PAD,
+	.arenas = 0,
+	.hugepages = HUGEPAGES_OFF,
+	.quarantine = QUARANTINE,
+};
+
+static arena_t arenas[MAX_ARENAS];
+static size_t narenas;
+static size_t arena_counter = 0;
+static void **prof_ptrs = NULL; // Sampled pointers by hash, next to each other so a lookup touches one cache line
+static sample_t *prof_samples; // The sample of each slot
+static size_t prof_allocs = 0; // Samples ever taken
+static size_t prof_bytes = 0;
+static size_t prof_dropped = 0; // Sampled allocations the table had no room for
+static size_t prof_dumps = 0;
+static __thread ssize_t prof_countdown = 0; // Bytes left before the thread takes its next sample
+static __thread uintptr_t prof_stack_end = 0; // The top of the thread's stack, 1 while it is being looked up
+extern char __ehdr_start[] __attribute__((visibility("hidden"))); // The text of the library, from the linker
+extern char __etext[] __attribute__((visibility("hidden")));
+static __thread uint64_t prof_random = 0;
+static out_t trace_out = { .fd = -1 }; // The trace log, written under trace_lock
+static lock_t trace_lock;
+static __thread bool trace_inner = false; // Inside realloc(), whose own calls of malloc() and free() are not logged
+static uint64_t check_secret; // Random, keeps cookies and the key of cached objects from being guessed
+static __thread uint64_t check_random = 0; // Picks the slots of slab objects
+static __thread size_t guard_countdown = 0; // Allocations left before the thread guards the next one
+static void *quarantine_maps[QUARANTINE_SLOTS]; // A ring of the mappings of freed guarded allocations, oldest first
+static size_t quarantine_lengths[QUARANTINE_SLOTS];
+static size_t quarantine_first = 0;
+static size_t quarantine_count = 0;
+static size_t quarantine_bytes = 0;
+static lock_t quarantine_lock;
+static bool background_pending = false; // The background thread is to be started by the next allocation under a lock
+static bool background_running = false;
+static size_t background_passes = 1; // Counts from 1, chunks binned before the last pass have been free for a whole interval
+static unsigned numa_nodes = 1; // More than one only with conf.numa on a NUMA machine
+static chunk_t *heap_start = NULL; // The extent of the sbrk() heap, which belongs to arenas[0]
+static void *heap_end = NULL;
+static size_t pagesize;
+static unsigned lock_spin = LOCK_SPIN; // No spinning with a single CPU, the holder cannot run meanwhile
+static size_t grow_unit; // The granularity heaps grow and shrink by, a page or a huge page
+static bool trim_dynamic = true; // Regrowth raises trim_threshold, until it or top_pad is set by hand
+static void *slab_base = NULL; // All slab pages come from one reservation, made accessible as needed
+static size_t slab_space = 0;
+static void *slab_top; // The first page never handed out
+static void *slab_committed;
+static void *slab_pages = NULL; // Pages of slabs that became empty, linked through their first word
+static uint64_t slab_purged[SLAB_SPACE / 4096 / 64]; // Empty pages given back with madvise(), by index into the reservation
+static size_t slab_npurged = 0;
+static lock_t slab_lock;
+static uint16_t slab_slots[NSLABCLASSES];
+static uint16_t slab_offset[NSLABCLASSES]; // Where the first object of a slab of each class starts
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static __thread bool booting = false; // Inside init(), allocations come from boot_heap
+static char boot_heap[BOOT_HEAP] __attribute__((aligned(64)));
+static size_t boot_used = 0;
+static __thread arena_t *thread_arena = NULL;
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static void *region_base = NULL; // Region blocks come from one reservation like slab pages
+static size_t region_space = 0;
+static void *region_top; // The first block never handed out
+static void *region_blocks = NULL; // Blocks of reset and destroyed regions, linked through their first word
+static uint64_t region_purged[REGION_SPACE / REGION_BLOCK / 64]; // Free blocks given back with madvise()
+static size_t region_npurged = 0;
+static lock_t region_lock;
+static lock_t stats_lock; // Guards the list of caches and what exited threads left behind
+static tcache_t *tcaches = NULL;
+static size_t retired_hits[NSMALLBINS];
+static size_t retired_puts = 0;
+static size_t mapped_count = 0; // Chunks with a mapping of their own, updated atomically
+static size_t mapped_bytes = 0;
+static size_t mapped_max = 0;
+static size_t mapped_max_count = 0;
+static size_t mapped_allocs = 0;
+
+
+static void print_chunk(chunk_t *chunk);
+static size_t chunk_size(chunk_t *);
+static bool is_free(chunk_t *);
+static chunk_t *next_chunk(chunk_t *);
+static chunk_t *prev_chunk(chunk_t *);
+static chunk_t *chunk_of(void *);
+static size_t request_size(size_t);
+static void print_heap(arena_t *);
+static void debug_region(chunk_t *);
+static void debug_heap(arena_t *);
+static void cpu_relax();
+static bool lock_try(lock_t *);
+static void lock_acquire(lock_t *);
+static void lock_release(lock_t *);
+static void arena_lock(arena_t *);
+static void arena_unlock(arena_t *);
+static void system_add(arena_t *, ssize_t);
+static void map_add(ssize_t, ssize_t);
+static void atomic_max(size_t *, size_t);
+static void init();
+static void setup();
+static void fork_prepare();
+static void fork_parent();
+static void fork_child();
+static void conf_init();
+static bool conf_size(const char *, size_t, size_t *);
+static bool conf_hugepages(const char *, size_t, int *);
+static unsigned numa_detect();
+static void numa_bind(arena_t *, void *, size_t);
+static arena_t *arena_get();
+static arena_t *arena_of(chunk_t *);
+static links_t *links(chunk_t *);
+static size_t bin_index(size_t);
+static size_t bin_size(size_t);
+static void bin_insert(arena_t *, chunk_t *);
+static void bin_remove(arena_t *, chunk_t *);
+static size_t next_bin(arena_t *, size_t);
+static tree_t *tree(chunk_t *);
+static bool tree_before(chunk_t *, chunk_t *);
+static uint64_t tree_priority(chunk_t *);
+static chunk_t *tree_insert(chunk_t *, chunk_t *);
+static chunk_t *tree_merge(chunk_t *, chunk_t *);
+static chunk_t *tree_remove(chunk_t *, chunk_t *);
+static chunk_t *tree_fit(chunk_t *, size_t);
+static void debug_tree(chunk_t *, size_t, size_t *);
+static bool segment_create(arena_t *, size_t);
+static bool grow(arena_t *, size_t);
+static chunk_t *extend(arena_t *, size_t);
+static bool trim_top(arena_t *, size_t);
+static bool segments_unmap(arena_t *);
+static bool purge_chunk(chunk_t *);
+static chunk_t *best_fit(arena_t *, size_t);
+static void crop(arena_t *, chunk_t *, size_t);
+static void release(arena_t *, chunk_t *);
+static void defer(arena_t *, chunk_t *);
+static bool consolidate(arena_t *);
+static void *resize(arena_t *, chunk_t *, size_t);
+static chunk_t *align_chunk(arena_t *, chunk_t *, size_t);
+static void mark_dirty(arena_t *, chunk_t *, size_t);
+static size_t dirty_size(arena_t *, chunk_t *);
+static bool is_slab(void *);
+static slab_t *slab_of(void *);
+static arena_t *owner(void *);
+static size_t usable_size(void *);
+static void slab_layout();
+static slab_t *slab_create(arena_t *, size_t);
+static void *slab_alloc(arena_t *, size_t);
+static bool slab_purge();
+static void slab_release(arena_t *, slab_t *, void *);
+static void release_ptr(arena_t *, void *);
+static void remote_push(arena_t *, void *);
+static void remote_drain(arena_t *);
+static void *map_chunk(size_t, size_t);
+static void unmap_chunk(chunk_t *);
+static void *remap_chunk(chunk_t *, size_t);
+static bool is_guarded(chunk_t *);
+static void *guard_chunk(size_t, size_t);
+static void quarantine(chunk_t *);
+static void tcache_create_key();
+static void tcache_init();
+static void tcache_spill(size_t, size_t);
+static void tcache_gc();
+static void tcache_scavenge(bool);
+static void background_start();
+static void *background_main(void *);
+static void background_pass();
+static bool is_stale(chunk_t *);
+static void tcache_drain(void *);
+static void dealloc(void *, size_t);
+static bool is_region(void *);
+static size_t region_extent(void *);
+static void *region_block();
+static void *region_map(qalloc_region_t *, size_t);
+static bool region_purge();
+static size_t carve(arena_t *, chunk_t *, size_t, size_t, void **);
+static int address_order(const void *, const void *);
+static void batch_track(void **, size_t, size_t);
+static void *boot_alloc(size_t, size_t);
+static bool is_boot(void *);
+static void *allocate(size_t, size_t, bool);
+static void *alloc(size_t, size_t, bool);
+static void prof_init();
+static double prof_exponential();
+static size_t prof_slot(void *);
+static void prof_sample(void *, size_t);
+static uintptr_t prof_stack();
+static void prof_forget(void *);
+static void prof_dump();
+static void prof_signal(int);
+static void prof_exit();
+static void trace_open();
+static void trace(char, size_t, size_t, void *);
+static void trace_exit();
+static void *reallocate(void *, size_t);
+static size_t cookie(chunk_t *);
+static void check_stamp(void *);
+static bool check_verify(void *);
+static void check_free(void *);
+static void check_cached(void *, size_t);
+static void check_fail(const char *, void *);
+static int out_open(out_t *, const char *, ssize_t);
+static void out_flush(out_t *);
+static void out_string(out_t *, const char *);
+static void out_number(out_t *, size_t, unsigned);
+static void stats_read(arena_t *, stats_t *);
+static void thread_stats(size_t *, size_t *, size_t *);
+static void free_sizes(arena_t *, size_t *, size_t *);
+#pragma GCC visibility push(default)
+void *malloc(size_t);
+void free(void *);
+void *calloc(size_t, size_t);
+void *realloc(void *, size_t);
+void *reallocarray(void *, size_t, size_t);
+size_t malloc_usable_size(void *);
+void *aligned_alloc(size_t, size_t);
+int posix_memalign(void **, size_t, size_t);
+void *memalign(size_t, size_t);
+void *valloc(size_t);
+void *pvalloc(size_t);
+int mallopt(int, int);
+int malloc_trim(size_t);
+struct mallinfo2 mallinfo2(void);
+struct mallinfo mallinfo(void);
+void malloc_stats(void);
+int malloc_info(int, FILE *);
+#pragma GCC visibility pop
+
+
+static void print_chunk(chunk_t *chunk) {
+	fprintf(stderr, "Addr: %p\n", chunk);
+	fprintf(stderr, "Size: %d\n", chunk_size(chunk));
+	fprintf(stderr, "Free: %b\n", is_free(chunk));
+	fprintf(stderr, "Prev in use: %b\n", (chunk->head & PREV_INUSE) != 0);
+	fprintf(stderr, "Mmapped: %b\n", (chunk->head & MMAPPED) != 0);
+	if (!(chunk->head & PREV_INUSE)) fprintf(stderr, "Prev: %p\n", prev_chunk(chunk));
+	if (chunk_size(chunk)) fprintf(stderr, "Data: %d bytes\n", chunk_size(chunk) - OVERHEAD);
+	else fprintf(stderr, "Data: 0 bytes\n");
+	fprintf(stderr, "\n");
+}
+
+static void print_heap(arena_t *arena) {
+	if (arena == &arenas[0]) {
+		for (chunk_t *chunk = heap_start; chunk != NULL; chunk = chunk_size(chunk) ? next_chunk(chunk) : NULL) print_chunk(chunk);
+	}
+	for (segment_t *segment = arena->segments; segment != NULL; segment = segment->next) {
+		for (chunk_t *chunk = (void *)segment + SEGMENT_HEADER; chunk != NULL; chunk = chunk_size(chunk) ? next_chunk(chunk) : NULL) print_chunk(chunk);
+	}
+}
+
+// Walk the chunks of a contiguous region and check that the flags and footers agree with the sizes
+static void debug_region(chunk_t *first_chunk) {
+	if (!(first_chunk->head & PREV_INUSE)) {
+		fprintf(stderr, "Error, first chunk without PREV_INUSE!\n");
+		print_chunk(first_chunk);
+		exit(EXIT_FAILURE);
+	}
+	for (chunk_t *chunk = first_chunk; chunk_size(chunk) != 0; chunk = next_chunk(chunk)) {
+		chunk_t *next = next_chunk(chunk);
+		if (chunk_size(chunk) % ALIGNMENT || chunk_size(chunk) < MIN_CHUNK || (chunk->head & MMAPPED)) {
+			fprintf(stderr, "Error, malformed chunk header!\n");
+			print_chunk(chunk);
+			fprintf(stderr, "First chunk: %p\n", first_chunk);
+			exit(EXIT_FAILURE);
+		}
+		if (is_free(chunk) == ((next->head & PREV_INUSE) != 0)) {
+			fprintf(stderr, "Error, PREV_INUSE of the next chunk disagrees with the chunk!\n");
+			print_chunk(chunk);
+			print_chunk(next);
+			fprintf(stderr, "First chunk: %p\n", first_chunk);
+			exit(EXIT_FAILURE);
+		}
+		if (is_free(chunk) && (prev_chunk(next) != chunk || is_free(next))) {
+			fprintf(stderr, "Error, free chunk with a wrong footer or a free neighbour!\n");
+			print_chunk(chunk);
+			print_chunk(next);
+			fprintf(stderr, "First chunk: %p\n", first_chunk);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Check the order and the priorities of a treap, counting its chunks off those of the bin's list
+static void debug_tree(chunk_t *root, size_t index, size_t *count) {
+	if (!root) return;
+	chunk_t *left = tree(root)->left, *right = tree(root)->right;
+	if (!is_free(root) || bin_index(chunk_size(root)) != index || (left && (!tree_before(left, root) || tree_priority(left) > tree_priority(root)))
+		|| (right && (!tree_before(root, right) || tree_priority(right) > tree_priority(root)))) {
+		fprintf(stderr, "Error, misplaced tree node!\n");
+		print_chunk(root);
+		fprintf(stderr, "Bin: %d\n", index);
+		exit(EXIT_FAILURE);
+	}
+	(*count)--;
+	debug_tree(left, index, count);
+	debug_tree(right, index, count);
+}
+
+static void debug_heap(arena_t *arena) {
+	if (arena == &arenas[0] && heap_start) debug_region(heap_start);
+	for (segment_t *segment = arena->segments; segment != NULL; segment = segment->next) {
+		if (segment->arena != arena) {
+			fprintf(stderr, "Error, segment %p belongs to another arena!\n", segment);
+			exit(EXIT_FAILURE);
+		}
+		debug_region((void *)segment + SEGMENT_HEADER);
+	}
+	for (size_t index = 0; index < NBINS; index++) {
+		size_t count = 0;
+		for (chunk_t *chunk = arena->bins[index]; chunk != NULL; chunk = links(chunk)->fd) {
+			if (!is_free(chunk) || bin_index(chunk_size(chunk)) != index) {
+				fprintf(stderr, "Error, chunk in the wrong bin!\n");
+				print_chunk(chunk);
+				fprintf(stderr, "Bin: %d\n", index);
+				exit(EXIT_FAILURE);
+			}
+			count++;
+		}
+		if (index < NSMALLBINS) continue;
+		debug_tree(arena->trees[index - NSMALLBINS], index, &count);
+		if (count) {
+			fprintf(stderr, "Error, the tree of bin %d does not hold the chunks of its list!\n", index);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (size_t class = 0; class < NSLABCLASSES; class++) {
+		for (slab_t *slab = arena->slabs[class]; slab != NULL; slab = slab->next) {
+			if (slab->arena != arena || slab->size != (class + 1) * ALIGNMENT || !slab->nfree || slab->nfree > slab->nslots) {
+				fprintf(stderr, "Error, inconsistent slab %p of size %d with %d of %d slots free!\n", slab, slab->size, slab->nfree, slab->nslots);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+}
+
+
+static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+static bool lock_try(lock_t *lock) {
+	uint32_t expected = LOCK_FREE;
+	return __atomic_compare_exchange_n(&lock->word, &expected, LOCK_HELD, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void lock_acquire(lock_t *lock) {
+	if (lock_try(lock)) return;
+
+	// Critical sections are short, the holder is often done within a few hundred cycles
+	for (unsigned spins = 1; spins <= lock_spin; spins <<= 1) {
+		for (unsigned i = 0; i < spins; i++) cpu_relax();
+		if (__atomic_load_n(&lock->word, __ATOMIC_RELAXED) == LOCK_FREE && lock_try(lock)) return;
+	}
+
+	// Whoever takes the lock from here on leaves it marked, so that its release wakes the next sleeper
+	while (__atomic_exchange_n(&lock->word, LOCK_WAITERS, __ATOMIC_ACQUIRE) != LOCK_FREE) {
+		syscall(SYS_futex, &lock->word, FUTEX_WAIT_PRIVATE, LOCK_WAITERS, NULL, NULL, 0);
+	}
+}
+
+static void lock_release(lock_t *lock) {
+	if (__atomic_exchange_n(&lock->word, LOCK_FREE, __ATOMIC_RELEASE) == LOCK_WAITERS) {
+		syscall(SYS_futex, &lock->word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+// Take the lock of the arena, counting the times another thread held it
+static void arena_lock(arena_t *arena) {
+	if (!lock_try(&arena->lock)) {
+		lock_acquire(&arena->lock);
+		if (conf.stats) arena->stats.contended++;
+	}
+}
+
+static void arena_unlock(arena_t *arena) {
+	lock_release(&arena->lock);
+}
+
+// Account for heap space gained or given back, the caller holds the lock
+static void system_add(arena_t *arena, ssize_t size) {
+	arena->stats.system += size;
+	if (arena->stats.system > arena->stats.system_max) arena->stats.system_max = arena->stats.system;
+}
+
+// Account for mapped chunks, which are allocated and freed without any lock
+static void map_add(ssize_t count, ssize_t size) {
+	atomic_max(&mapped_max_count, __atomic_add_fetch(&mapped_count, count, __ATOMIC_RELAXED));
+	atomic_max(&mapped_max, __atomic_add_fetch(&mapped_bytes, size, __ATOMIC_RELAXED));
+}
+
+static void atomic_max(size_t *max, size_t value) {
+	size_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (value > old && !__atomic_compare_exchange_n(max, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Parse a size with an optional K, M or G suffix
+static bool conf_size(const char *value, size_t length, size_t *size) {
+	size_t result = 0, i = 0;
+	for (; i < length && value[i] >= '0' && value[i] <= '9'; i++) {
+		if (result > (SIZE_MAX - 9) / 10) return false;
+		result = result * 10 + value[i] - '0';
+	}
+	if (i == 0) return false;
+
+	size_t shift = 0;
+	if (i + 1 == length) {
+		switch (value[i++]) {
+		case 'k': case 'K': shift = 10; break;
+		case 'm': case 'M': shift = 20; break;
+		case 'g': case 'G': shift = 30; break;
+		default: return false;
+		}
+	}
+	if (i != length || result > (SIZE_MAX >> shift)) return false;
+	*size = result << shift;
+	return true;
+}
+
+static bool conf_hugepages(const char *value, size_t length, int *mode) {
+	if ((length == 3 && strncmp(value, "thp", 3) == 0) || (length == 1 && value[0] == '1')) *mode = HUGEPAGES_THP;
+	else if (length == 7 && strncmp(value, "hugetlb", 7) == 0) *mode = HUGEPAGES_HUGETLB;
+	else if ((length == 3 && strncmp(value, "off", 3) == 0) || (length == 1 && value[0] == '0')) *mode = HUGEPAGES_OFF;
+	else return false;
+	return true;
+}
+
+// Read QALLOC_CONF, a list like "arenas:4,mmap_threshold:1M,stats:0", and QALLOC_HUGEPAGES.
+// This runs inside the first malloc(), so nothing here may allocate.
+// Entries that do not parse keep their defaults, a single warning names the first of them.
+static void conf_init() {
+	conf.initial_size = INITIAL_SIZE * pagesize;
+	conf.extend_min = EXTEND_MIN * pagesize;
+
+	char *value = getenv("QALLOC_HUGEPAGES");
+	if (value) conf_hugepages(value, strlen(value), &conf.hugepages);
+
+	struct {
+		const char *name;
+		size_t *value;
+		size_t min;
+		size_t max;
+	} sizes[] = {
+		{ "initial_size", &conf.initial_size, 1, SEGMENT_SIZE / 2 },
+		{ "extend_min", &conf.extend_min, 1, SEGMENT_SIZE / 2 },
+		{ "mmap_threshold", &conf.mmap_threshold, 0, SIZE_MAX },
+		{ "trim_threshold", &conf.trim_threshold, 0, SIZE_MAX },
+		{ "top_pad", &conf.top_pad, 0, SEGMENT_SIZE / 2 },
+		{ "arenas", &conf.arenas, 0, MAX_ARENAS },
+		{ "tcache", &conf.tcache_count, 0, TCACHE_MAX },
+		{ "defer", &conf.defer, 0, SIZE_MAX },
+		{ "prof", &conf.prof_rate, 0, PTRDIFF_MAX },
+		{ "prof_signal", &conf.prof_signal, 0, 64 },
+		{ "guard", &conf.guard, 0, PTRDIFF_MAX },
+		{ "quarantine", &conf.quarantine, 0, SIZE_MAX },
+		{ "background", &conf.background, 0, 1000000 },
+	};
+
+	const char *bad = NULL;
+	size_t bad_length = 0;
+	for (const char *entry = getenv("QALLOC_CONF"); entry && *entry;) {
+		size_t length = strcspn(entry, ",");
+		size_t key_length = strcspn(entry, ":");
+		bool ok = false;
+		if (key_length < length) {
+			const char *arg = entry + key_length + 1;
+			size_t arg_length = length - key_length - 1;
+			size_t size;
+			if (key_length == 5 && strncmp(entry, "stats", 5) == 0) {
+				ok = conf_size(arg, arg_length, &size) && size <= 1;
+				if (ok) conf.stats = size;
+			}
+			else if (key_length == 4 && strncmp(entry, "numa", 4) == 0) {
+				ok = conf_size(arg, arg_length, &size) && size <= 1;
+				if (ok) conf.numa = size;
+			}
+			else if (key_length == 5 && strncmp(entry, "trace", 5) == 0) {
+				ok = conf_size(arg, arg_length, &size) && size <= 1;
+				if (ok) conf.trace = size;
+			}
+			else if (key_length == 5 && strncmp(entry, "check", 5) == 0) {
+				ok = conf_size(arg, arg_length, &size) && size <= 1;
+				if (ok) conf.check = size;
+			}
+			else if (key_length == 9 && strncmp(entry, "hugepages", 9) == 0) ok = conf_hugepages(arg, arg_length, &conf.hugepages);
+			for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+				if (strlen(sizes[i].name) != key_length || strncmp(entry, sizes[i].name, key_length) != 0) continue;
+				ok = conf_size(arg, arg_length, &size) && size >= sizes[i].min && size <= sizes[i].max;
+				if (ok) *sizes[i].value = size;
+				if (ok && (sizes[i].value == &conf.trim_threshold || sizes[i].value == &conf.top_pad)) trim_dynamic = false;
+			}
+		}
+		if (!ok && !bad) {
+			bad = entry;
+			bad_length = length;
+		}
+		entry += length;
+		if (*entry == ',') entry++;
+	}
+
+	if (bad) {
+		// stdio could allocate, write() cannot
+		const char *message = "qalloc: ignoring bad QALLOC_CONF entry: ";
+		write(STDERR_FILENO, message, strlen(message));
+		write(STDERR_FILENO, bad, bad_length);
+		write(STDERR_FILENO, "\n", 1);
+	}
+
+	conf.initial_size = (conf.initial_size + pagesize - 1) & ~(pagesize - 1);
+	conf.extend_min = (conf.extend_min + pagesize - 1) & ~(pagesize - 1);
+	grow_unit = conf.hugepages != HUGEPAGES_OFF && HUGE_PAGE > pagesize ? HUGE_PAGE : pagesize;
+}
+
+// Runs once, from boot() or from whatever first needs the settings.
+// Anything it allocates on the way is served from the bootstrap heap, never from the arenas being set up.
+static void init() {
+	booting = true;
+	setup();
+	booting = false;
+}
+
+// The profiler, the trace and the secret come first, the boot allocations are sampled, logged and stamped like any other
+static void setup() {
+	pagesize = sysconf(_SC_PAGESIZE);
+	conf_init();
+	if (conf.prof_rate) prof_init();
+	if (conf.trace) trace_open();
+	if (conf.check) {
+		// The kernel hands every process 16 random bytes, reading them needs no system call
+		const uint64_t *random = (const uint64_t *)getauxval(AT_RANDOM);
+		check_secret = (random ? random[0] ^ random[1] : (uintptr_t)&check_secret) | 1;
+	}
+	size_t size;
+	void *start;
+	void *end;
+
+	cpu_set_t cpus;
+	narenas = 1;
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) narenas = CPU_COUNT(&cpus) * ARENAS_PER_CPU;
+	if (narenas > MAX_ARENAS) narenas = MAX_ARENAS;
+	if (narenas <= ARENAS_PER_CPU) lock_spin = 0;
+	if (conf.arenas) narenas = conf.arenas;
+
+	// The same number of arenas for every node, arena i serves node i % numa_nodes
+	if (conf.numa) numa_nodes = numa_detect();
+	if (numa_nodes > 1) {
+		narenas = (narenas + numa_nodes - 1) / numa_nodes * numa_nodes;
+		if (narenas > MAX_ARENAS) narenas = MAX_ARENAS / numa_nodes * numa_nodes;
+	}
+	for (size_t i = 0; i < narenas; i++) arenas[i].node = i % numa_nodes;
+
+	if (pthread_atfork(fork_prepare, fork_parent, fork_child) != 0) {
+		perror("pthread_atfork");
+		exit(EXIT_FAILURE);
+	}
+	background_pending = conf.background != 0; // Creating a thread allocates, it has to wait until init() is done
+
+	// Without the reservation every size is served from chunks
+	slab_layout();
+	slab_base = mmap(NULL, SLAB_SPACE + grow_unit - pagesize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (slab_base != MAP_FAILED) {
+		// Slab pages are handed out in address order, so with huge pages the hot small objects share a few of them
+		slab_base = (void *)(((uintptr_t)slab_base + grow_unit - 1) & ~(grow_unit - 1));
+		if (conf.hugepages != HUGEPAGES_OFF) madvise(slab_base, SLAB_SPACE, MADV_HUGEPAGE);
+		slab_space = SLAB_SPACE;
+		slab_top = slab_committed = slab_base;
+	}
+	else slab_base = NULL;
+
+	region_base = mmap(NULL, REGION_SPACE + grow_unit - pagesize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (region_base != MAP_FAILED) {
+		region_base = (void *)(((uintptr_t)region_base + grow_unit - 1) & ~(grow_unit - 1));
+		if (conf.hugepages != HUGEPAGES_OFF) madvise(region_base, REGION_SPACE, MADV_HUGEPAGE);
+		region_space = REGION_SPACE;
+		region_top = region_base;
+	}
+	else region_base = NULL;
+
+	// Huge TLB pages cannot come from sbrk(), the main arena grows by segments as well.
+	// So it does with NUMA, the break would be placed wherever its pages are first touched.
+	if (conf.hugepages == HUGEPAGES_HUGETLB || numa_nodes > 1) return;
+	size = (conf.initial_size + grow_unit - 1) & ~(grow_unit - 1);
+
+	// Without sbrk() the main arena starts out empty and grows by segments instead.
+	// The break may start unaligned, so ask for the difference as well and keep the end on a boundary.
+	size_t misalign = -(uintptr_t)sbrk(0) & (grow_unit - 1);
+	if ((start = (sbrk(misalign + size))) == (void *)-1) return;
+	end = start + misalign + size;
+	assert(end == sbrk(0));
+	start += misalign;
+	if (conf.hugepages == HUGEPAGES_THP) madvise(start, size, MADV_HUGEPAGE);
+
+	// The region ends in a chunk of size 0 that is always in use, coalescing stops there
+	arena_t *arena = &arenas[0];
+	chunk_t *first_chunk = (chunk_t *)start;
+	chunk_t *last_chunk = (chunk_t *)(end - sizeof(chunk_t));
+	first_chunk->head = ((void *)last_chunk - start) | PREV_INUSE;
+	last_chunk->prev_size = chunk_size(first_chunk);
+	last_chunk->head = INUSE;
+
+	arena->first_chunk = first_chunk;
+	arena->last_chunk = last_chunk;
+	arena->zero = first_chunk;
+	system_add(arena, end - start);
+	heap_start = first_chunk;
+	heap_end = end;
+	bin_insert(arena, first_chunk);
+}
+
+// Initializes before main(), so the allocation paths never wait on init_once and short-lived programs start up the same way every time
+__attribute__((constructor)) static void boot() {
+	pthread_once(&init_once, init);
+}
+
+// Around fork() every lock is held, so the child never inherits one that a vanished thread held.
+// Locks go in the order they nest: the arenas by index, then the slab, region, quarantine, trace and stats locks.
+static void fork_prepare() {
+	for (size_t i = 0; i < narenas; i++) lock_acquire(&arenas[i].lock);
+	lock_acquire(&slab_lock);
+	lock_acquire(&region_lock);
+	lock_acquire(&quarantine_lock);
+	lock_acquire(&trace_lock);
+	lock_acquire(&stats_lock);
+}
+
+static void fork_parent() {
+	lock_release(&stats_lock);
+	lock_release(&trace_lock);
+	lock_release(&quarantine_lock);
+	lock_release(&region_lock);
+	lock_release(&slab_lock);
+	for (size_t i = narenas; i-- > 0;) lock_release(&arenas[i].lock);
+}
+
+// Only the forking thread lives on in the child, so the locks start over and the caches
+// of the other threads are retired. What those held stays allocated.
+static void fork_child() {
+	for (size_t i = 0; i < narenas; i++) arenas[i].lock.word = LOCK_FREE;
+	slab_lock.word = LOCK_FREE;
+	region_lock.word = LOCK_FREE;
+	quarantine_lock.word = LOCK_FREE;
+	trace_lock.word = LOCK_FREE;
+	stats_lock.word = LOCK_FREE;
+
+	// The background thread did not survive the fork, the next allocation starts another
+	if (background_running) {
+		background_running = false;
+		background_pending = true;
+	}
+
+	// What the parent had buffered is its own to write, the child logs to a file of its own
+	if (conf.trace) {
+		close(trace_out.fd);
+		trace_open();
+	}
+
+	for (tcache_t *tc = tcaches; tc != NULL; tc = tc->next) {
+		if (tc == &tcache) continue;
+		for (size_t index = 0; index < NSMALLBINS; index++) retired_hits[index] += tc->hits[index];
+		retired_puts += tc->puts;
+	}
+	tcaches = NULL;
+	if (tcache.state == TCACHE_ACTIVE) {
+		tcache.prev = tcache.next = NULL;
+		tcaches = &tcache;
+	}
+}
+
+// The number of NUMA nodes, from the highest one the kernel lists as online.
+// Read with plain system calls, stdio would allocate.
+static unsigned numa_detect() {
+	char buffer[256];
+	int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 1;
+	ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (length <= 0) return 1;
+	buffer[length] = '\0';
+
+	// A list of ranges like "0-1,4", the last number is the highest
+	unsigned node = 0, highest = 0;
+	for (char *c = buffer; *c; c++) {
+		if (*c >= '0' && *c <= '9') node = node * 10 + (*c - '0');
+		else {
+			if (node > highest) highest = node;
+			node = 0;
+		}
+	}
+	if (node > highest) highest = node;
+	return highest + 1 < MAX_NODES ? highest + 1 : MAX_NODES;
+}
+
+// Prefer the node of the arena for pages not touched yet, other nodes still serve when it runs out
+static void numa_bind(arena_t *arena, void *start, size_t size) {
+	if (numa_nodes <= 1) return;
+	uint64_t mask = 1ULL << arena->node;
+	syscall(SYS_mbind, start, size, MPOL_PREFERRED, &mask, MAX_NODES + 1, 0);
+}
+
+// With NUMA a thread follows the node it runs on, checked on every allocation that takes a lock
+static arena_t *arena_get() {
+	if (!thread_arena) pthread_once(&init_once, init);
+
+	unsigned node = 0;
+	if (numa_nodes > 1 && getcpu(NULL, &node) == 0) node %= numa_nodes;
+	if (!thread_arena || thread_arena->node != node) {
+		size_t slot = __atomic_fetch_add(&arena_counter, 1, __ATOMIC_RELAXED) % (narenas / numa_nodes);
+		thread_arena = &arenas[slot * numa_nodes + node];
+	}
+	return thread_arena;
+}
+
+static arena_t *arena_of(chunk_t *chunk) {
+	if (chunk >= heap_start && (void *)chunk < heap_end) return &arenas[0];
+	return ((segment_t *)((uintptr_t)chunk & ~(SEGMENT_SIZE - 1)))->arena;
+}
+
+static size_t chunk_size(chunk_t *chunk) {
+	return chunk->head & SIZE_MASK;
+}
+
+static bool is_free(chunk_t *chunk) {
+	return !(chunk->head & INUSE);
+}
+
+static chunk_t *next_chunk(chunk_t *chunk) {
+	return (void *)chunk + chunk_size(chunk);
+}
+
+// Only valid while the chunk before is free
+static chunk_t *prev_chunk(chunk_t *chunk) {
+	return (void *)chunk - chunk->prev_size;
+}
+
+static chunk_t *chunk_of(void *ptr) {
+	return (chunk_t *)(ptr - sizeof(chunk_t));
+}
+
+// The size of the chunk that holds size bytes
+static size_t request_size(size_t size) {
+	size = (size + OVERHEAD + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	return size < MIN_CHUNK ? MIN_CHUNK : size;
+}
+
+static links_t *links(chunk_t *chunk) {
+	return (links_t *)((void *)chunk + sizeof(chunk_t));
+}
+
+// Sizes up to MAX_SMALL get a bin each, larger sizes share a bin with
+// everything in the same quarter of their power of two
+static size_t bin_index(size_t size) {
+	if (size <= MAX_SMALL) return size / ALIGNMENT - 1;
+	size_t log = 63 - __builtin_clzll(size);
+	size_t index = NSMALLBINS + (log - __builtin_ctzll(MAX_SMALL)) * 4 + ((size >> (log - 2)) & 3);
+	return index < NBINS ? index : NBINS - 1;
+}
+
+// The smallest size that goes into the bin
+static size_t bin_size(size_t index) {
+	if (index < NSMALLBINS) return index * ALIGNMENT + 1;
+	size_t log = (index - NSMALLBINS) / 4 + __builtin_ctzll(MAX_SMALL);
+	size_t size = (1UL << log) + ((index - NSMALLBINS) % 4) * (1UL << (log - 2));
+	return index == NSMALLBINS ? MAX_SMALL + 1 : size;
+}
+
+static void bin_insert(arena_t *arena, chunk_t *chunk) {
+	size_t index = bin_index(chunk_size(chunk));
+	arena->stats.free += chunk_size(chunk);
+	arena->stats.nchunks++;
+	links(chunk)->fd = arena->bins[index];
+	links(chunk)->bk = NULL;
+	if (arena->bins[index]) links(arena->bins[index])->bk = chunk;
+	arena->bins[index] = chunk;
+	arena->binmap[index / 64] |= 1ULL << (index % 64);
+	if (index >= NSMALLBINS) {
+		tree(chunk)->binned = __atomic_load_n(&background_passes, __ATOMIC_RELAXED);
+		arena->trees[index - NSMALLBINS] = tree_insert(arena->trees[index - NSMALLBINS], chunk);
+	}
+}
+
+static void bin_remove(arena_t *arena, chunk_t *chunk) {
+	size_t index = bin_index(chunk_size(chunk));
+	arena->stats.free -= chunk_size(chunk);
+	arena->stats.nchunks--;
+	links_t *l = links(chunk);
+	if (conf.check && ((l->fd && links(l->fd)->bk != chunk) || (l->bk ? links(l->bk)->fd != chunk : arena->bins[index] != chunk))) {
+		check_fail("corrupted free list", (void *)chunk + sizeof(chunk_t));
+	}
+	if (l->fd) links(l->fd)->bk = l->bk;
+	if (l->bk) links(l->bk)->fd = l->fd;
+	else arena->bins[index] = l->fd;
+	if (!arena->bins[index]) arena->binmap[index / 64] &= ~(1ULL << (index % 64));
+	if (index >= NSMALLBINS) arena->trees[index - NSMALLBINS] = tree_remove(arena->trees[index - NSMALLBINS], chunk);
+}
+
+static tree_t *tree(chunk_t *chunk) {
+	return (void *)chunk + sizeof(chunk_t);
+}
+
+static bool tree_before(chunk_t *a, chunk_t *b) {
+	return chunk_size(a) < chunk_size(b) || (chunk_size(a) == chunk_size(b) && a < b);
+}
+
+static uint64_t tree_priority(chunk_t *chunk) {
+	return ((uintptr_t)chunk >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+// Add the chunk below root and return the new root, rotating it up past parents of lower priority
+static chunk_t *tree_insert(chunk_t *root, chunk_t *chunk) {
+	if (!root) {
+		tree(chunk)->left = tree(chunk)->right = NULL;
+		return chunk;
+	}
+	if (tree_before(chunk, root)) {
+		chunk_t *left = tree(root)->left = tree_insert(tree(root)->left, chunk);
+		if (tree_priority(left) <= tree_priority(root)) return root;
+		tree(root)->left = tree(left)->right;
+		tree(left)->right = root;
+		return left;
+	}
+	chunk_t *right = tree(root)->right = tree_insert(tree(root)->right, chunk);
+	if (tree_priority(right) <= tree_priority(root)) return root;
+	tree(root)->right = tree(right)->left;
+	tree(right)->left = root;
+	return right;
+}
+
+// Join two treaps, everything in a comes before everything in b
+static chunk_t *tree_merge(chunk_t *a, chunk_t *b) {
+	if (!a) return b;
+	if (!b) return a;
+	if (tree_priority(a) > tree_priority(b)) {
+		tree(a)->right = tree_merge(tree(a)->right, b);
+		return a;
+	}
+	tree(b)->left = tree_merge(a, tree(b)->left);
+	return b;
+}
+
+// Take the chunk out from below root and return the new root.
+// The chunk must still have the size it was inserted with.
+static chunk_t *tree_remove(chunk_t *root, chunk_t *chunk) {
+	if (root == chunk) return tree_merge(tree(chunk)->left, tree(chunk)->right);
+	if (tree_before(chunk, root)) tree(root)->left = tree_remove(tree(root)->left, chunk);
+	else tree(root)->right = tree_remove(tree(root)->right, chunk);
+	return root;
+}
+
+// The smallest chunk of at least size bytes, the lowest one of those that are equally small
+static chunk_t *tree_fit(chunk_t *root, size_t size) {
+	chunk_t *best = NULL;
+	while (root) {
+		if (chunk_size(root) >= size) {
+			best = root;
+			root = tree(root)->left;
+		}
+		else root = tree(root)->right;
+	}
+	return best;
+}
+
+// Return the first non-empty bin at or above index, NBINS if there is none
+static size_t next_bin(arena_t *arena, size_t index) {
+	for (size_t word = index / 64; word < NBINS / 64; word++) {
+		uint64_t bits = arena->binmap[word];
+		if (word == index / 64) bits &= ~0ULL << (index % 64);
+		if (bits) return word * 64 + __builtin_ctzll(bits);
+	}
+	return NBINS;
+}
+
+// Map a new segment of at least size bytes past its header and make it the region the arena grows.
+// Its single free chunk is binned.
+static bool segment_create(arena_t *arena, size_t size) {
+	size = (SEGMENT_HEADER + size + sizeof(chunk_t) + grow_unit - 1) & ~(grow_unit - 1);
+	if (size > SEGMENT_SIZE) return false;
+
+	// Reserve twice the size so that an aligned segment fits, then drop the excess.
+	// Huge TLB pages are reserved up front, fall back to ordinary ones when there are not enough.
+	void *map = MAP_FAILED;
+	if (conf.hugepages == HUGEPAGES_HUGETLB) map = mmap(NULL, 2 * SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (map == MAP_FAILED) map = mmap(NULL, 2 * SEGMENT_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) return false;
+	void *start = (void *)(((uintptr_t)map + SEGMENT_SIZE - 1) & ~(SEGMENT_SIZE - 1));
+	if (start != map) munmap(map, start - map);
+	munmap(start + SEGMENT_SIZE, map + SEGMENT_SIZE - start);
+	if (conf.hugepages == HUGEPAGES_THP) madvise(start, SEGMENT_SIZE, MADV_HUGEPAGE);
+	numa_bind(arena, start, SEGMENT_SIZE);
+	if (mprotect(start, size, PROT_READ | PROT_WRITE) != 0) {
+		munmap(start, SEGMENT_SIZE);
+		return false;
+	}
+
+	segment_t *segment = start;
+	segment->arena = arena;
+	segment->next = arena->segments;
+	segment->top = start + size;
+	segment->end = start + SEGMENT_SIZE;
+	arena->segments = segment;
+
+	chunk_t *first_chunk = start + SEGMENT_HEADER;
+	chunk_t *last_chunk = segment->top - sizeof(chunk_t);
+	first_chunk->head = ((void *)last_chunk - (void *)first_chunk) | PREV_INUSE;
+	last_chunk->prev_size = chunk_size(first_chunk);
+	last_chunk->head = INUSE;
+
+	arena->first_chunk = first_chunk;
+	arena->last_chunk = last_chunk;
+	arena->zero = first_chunk;
+	system_add(arena, size);
+	bin_insert(arena, first_chunk);
+	return true;
+}
+
+// Add size bytes to the end of the region the arena currently grows.
+// The main arena uses sbrk() for as long as the break stays where it left it.
+static bool grow(arena_t *arena, size_t size) {
+	if (!arena->first_chunk) return false;
+	if (arena->segments) {
+		segment_t *segment = arena->segments;
+		if ((size_t)(segment->end - segment->top) < size) return false;
+		if (mprotect(segment->top, size, PROT_READ | PROT_WRITE) != 0) return false;
+		segment->top += size;
+		system_add(arena, size);
+		return true;
+	}
+
+	void *start = sbrk(size);
+	if (start == (void *)(-1)) return false;
+	if (start != heap_end) { // Somebody else moved the break
+		sbrk(-size);
+		return false;
+	}
+	heap_end = start + size;
+	if (conf.hugepages == HUGEPAGES_THP) madvise(start, size, MADV_HUGEPAGE);
+	system_add(arena, size);
+	return true;
+}
+
+// Grow the arena by at least size bytes and return the free chunk at its top, already binned.
+// It grows by top_pad more, so the next requests fit without growing again.
+static chunk_t *extend(arena_t *arena, size_t size) {
+	if (size < conf.extend_min) size = conf.extend_min;
+	if (conf.stats) arena->stats.extends++;
+
+	// Growing back what was just trimmed, the next burst of frees must leave it alone
+	if (arena->trimmed && trim_dynamic) {
+		size_t threshold = 2 * (arena->trimmed + conf.top_pad);
+		atomic_max(&conf.trim_threshold, threshold < TRIM_THRESHOLD_MAX ? threshold : TRIM_THRESHOLD_MAX);
+	}
+	arena->trimmed = 0;
+
+	size_t least = (size + sizeof(chunk_t) + grow_unit - 1) & ~(grow_unit - 1); // Align the size
+	size_t size_aligned = (size + conf.top_pad + sizeof(chunk_t) + grow_unit - 1) & ~(grow_unit - 1);
+	if (!grow(arena, size_aligned)) {
+		size_aligned = least; // The pad may be what does not fit
+		if (!grow(arena, size_aligned)) {
+			if (!arena->first_chunk && size_aligned < conf.initial_size) size_aligned = conf.initial_size;
+			if (!segment_create(arena, size_aligned)) return NULL;
+			return arena->first_chunk;
+		}
+	}
+
+	// The old end of the region becomes the new space
+	chunk_t *chunk = arena->last_chunk;
+	chunk->head = size_aligned | (chunk->head & PREV_INUSE);
+	chunk_t *last_chunk = next_chunk(chunk);
+	last_chunk->head = INUSE;
+	arena->last_chunk = last_chunk;
+
+	// Merge the new space with a free chunk at the old end of the heap
+	if (!(chunk->head & PREV_INUSE)) {
+		chunk_t *prev = prev_chunk(chunk);
+		bin_remove(arena, prev);
+		prev->head += size_aligned;
+		memset(chunk, 0, sizeof(chunk_t)); // The old end is inside the free chunk now, keep it from spoiling the zeroes
+		chunk = prev;
+	}
+	last_chunk->prev_size = chunk_size(chunk);
+	bin_insert(arena, chunk);
+
+	return chunk;
+}
+
+// Give the free space at the end of the region the arena grows back to the OS, keeping pad bytes of it.
+// The caller holds the lock of the arena.
+static bool trim_top(arena_t *arena, size_t pad) {
+	chunk_t *last_chunk = arena->last_chunk;
+	if (!last_chunk || (last_chunk->head & PREV_INUSE)) return false;
+	chunk_t *chunk = prev_chunk(last_chunk);
+
+	void *end = (void *)last_chunk + sizeof(chunk_t);
+	void *new_end = (void *)(((uintptr_t)chunk + request_size(pad) + sizeof(chunk_t) + grow_unit - 1) & ~(grow_unit - 1));
+	if (new_end >= end || conf.hugepages == HUGEPAGES_HUGETLB) return false;
+
+	if (arena->segments) {
+		segment_t *segment = arena->segments;
+		if (madvise(new_end, end - new_end, MADV_DONTNEED) != 0) return false;
+		mprotect(new_end, end - new_end, PROT_NONE);
+		segment->top = new_end;
+	}
+	else {
+		if (sbrk(0) != heap_end || sbrk(-(end - new_end)) == (void *)(-1)) return false;
+		heap_end = new_end;
+	}
+
+	system_add(arena, -(end - new_end));
+	arena->trimmed = end - new_end;
+	if (conf.stats) arena->stats.trims++;
+	bin_remove(arena, chunk);
+	last_chunk = new_end - sizeof(chunk_t);
+	chunk->head = ((void *)last_chunk - (void *)chunk) | PREV_INUSE;
+	last_chunk->prev_size = chunk_size(chunk);
+	last_chunk->head = INUSE;
+	arena->last_chunk = last_chunk;
+	bin_insert(arena, chunk);
+	return true;
+}
+
+// Unmap the segments, other than the one being grown, that no longer hold anything
+static bool segments_unmap(arena_t *arena) {
+	bool released = false;
+	for (segment_t **link = &arena->segments; *link != NULL;) {
+		segment_t *segment = *link;
+		chunk_t *chunk = (void *)segment + SEGMENT_HEADER;
+		if (segment != arena->segments && is_free(chunk) && chunk_size(next_chunk(chunk)) == 0) {
+			bin_remove(arena, chunk);
+			*link = segment->next;
+			system_add(arena, -(segment->top - (void *)segment));
+			munmap(segment, SEGMENT_SIZE);
+			released = true;
+		}
+		else link = &segment->next;
+	}
+	return released;
+}
+
+// Drop the whole pages inside a free chunk, they come back zeroed when touched.
+// The bin links and tree node at the start of the payload are left alone.
+static bool purge_chunk(chunk_t *chunk) {
+	// Only whole huge pages, anything less would break them up
+	void *start = (void *)(((uintptr_t)chunk + FREE_HEADER + grow_unit - 1) & ~(grow_unit - 1));
+	void *end = (void *)(((uintptr_t)chunk + chunk_size(chunk)) & ~(grow_unit - 1));
+	if (start >= end || conf.hugepages == HUGEPAGES_HUGETLB) return false;
+	return madvise(start, end - start, MADV_DONTNEED) == 0;
+}
+
+// Return the smallest fitting chunk from the first bin that has one.
+// Every chunk in an exact-size bin fits equally well, a log-spaced bin gives its lowest best fit.
+// Only the first bin looked at can come up empty, every chunk in the ones above fits.
+static chunk_t *best_fit(arena_t *arena, size_t size) {
+	for (size_t index = next_bin(arena, bin_index(size)); index < NBINS; index = next_bin(arena, index + 1)) {
+		if (index < NSMALLBINS) return arena->bins[index];
+		chunk_t *chunk = tree_fit(arena->trees[index - NSMALLBINS], size);
+		if (chunk) return chunk;
+	}
+	return NULL;
+}
+
+// Crop the chunk, which is in use, to size.
+// A new free chunk is created out of the leftover space and binned,
+// merged with the following chunk if that one is free as well.
+// Passed size should come from request_size()!
+static void crop(arena_t *arena, chunk_t *chunk, size_t size) {
+	size_t leftover = chunk_size(chunk) - size;
+
+	if (leftover >= MIN_CHUNK) {
+		chunk_t *new = (chunk_t *)((void *)chunk + size);
+		chunk_t *next = next_chunk(chunk);
+		chunk->head = size | (chunk->head & FLAGS);
+
+		if (is_free(next)) {
+			bin_remove(arena, next);
+			mark_dirty(arena, next, FREE_HEADER);
+			leftover += chunk_size(next);
+		}
+		new->head = leftover | PREV_INUSE;
+		next = next_chunk(new);
+		next->prev_size = leftover;
+		next->head &= ~PREV_INUSE;
+		bin_insert(arena, new);
+	}
+}
+
+// Resize the chunk, which is in use, to size without leaving its place in the heap.
+// Growing takes the free chunk after it, more space at the top of the arena
+// or, moving the data down, the free chunk before it.
+// Returns the new address of the data or NULL if it has to be copied elsewhere.
+// The caller holds the lock of the arena, passed size should come from request_size()!
+static void *resize(arena_t *arena, chunk_t *chunk, size_t size) {
+	chunk_t *next = next_chunk(chunk);
+	size_t available = chunk_size(chunk) + (is_free(next) ? chunk_size(next) : 0);
+
+	// At the top of the arena the heap itself can grow behind the chunk
+	if (available < size && (next == arena->last_chunk || (is_free(next) && next_chunk(next) == arena->last_chunk))) {
+		extend(arena, size - available);
+		next = next_chunk(chunk);
+		available = chunk_size(chunk) + (is_free(next) ? chunk_size(next) : 0);
+	}
+
+	if (available >= size) {
+		if (chunk_size(chunk) < size) {
+			bin_remove(arena, next);
+			chunk->head += chunk_size(next);
+			next_chunk(chunk)->head |= PREV_INUSE;
+		}
+		crop(arena, chunk, size);
+		mark_dirty(arena, chunk, chunk_size(chunk) + OVERHEAD);
+		return (void *)chunk + sizeof(chunk_t);
+	}
+
+	// Moving down into the free chunk before costs the same copy as a new allocation, without the search
+	if (!(chunk->head & PREV_INUSE) && available + chunk->prev_size >= size) {
+		chunk_t *prev = prev_chunk(chunk);
+		size_t used = chunk_size(chunk) - OVERHEAD;
+		bin_remove(arena, prev);
+		if (is_free(next)) bin_remove(arena, next);
+		prev->head = (chunk_size(prev) + available) | INUSE | PREV_INUSE;
+		memmove((void *)prev + sizeof(chunk_t), (void *)chunk + sizeof(chunk_t), used);
+		next_chunk(prev)->head |= PREV_INUSE;
+		crop(arena, prev, size);
+		mark_dirty(arena, prev, chunk_size(prev) + OVERHEAD);
+		return (void *)prev + sizeof(chunk_t);
+	}
+	return NULL;
+}
+
+// Move the start of the chunk, which is in use, up until its payload is aligned.
+// The space skipped is freed as a chunk of its own, so it has to be at least MIN_CHUNK.
+// The caller asks for alignment + MIN_CHUNK bytes more than it needs, which always leaves room.
+static chunk_t *align_chunk(arena_t *arena, chunk_t *chunk, size_t alignment) {
+	uintptr_t payload = (uintptr_t)chunk + sizeof(chunk_t);
+	uintptr_t aligned = (payload + alignment - 1) & ~(alignment - 1);
+	if (aligned == payload) return chunk;
+	if (aligned - payload < MIN_CHUNK) aligned += alignment;
+
+	size_t lead = aligned - payload;
+	chunk_t *new = (chunk_t *)(aligned - sizeof(chunk_t));
+	new->head = (chunk_size(chunk) - lead) | INUSE | PREV_INUSE;
+	chunk->head = lead | INUSE | (chunk->head & PREV_INUSE);
+	release(arena, chunk);
+	return new;
+}
+
+// The first size bytes from chunk may have been written to, so they are no longer known to be zero.
+// Only the region the arena currently grows is tracked.
+static void mark_dirty(arena_t *arena, chunk_t *chunk, size_t size) {
+	void *end = (void *)chunk + size;
+	if (end > arena->zero && chunk >= arena->first_chunk && chunk < arena->last_chunk) arena->zero = end;
+}
+
+// How much of the payload of the chunk, just taken out of a bin, calloc() has to clear.
+// The links and tree nodes of free chunks sit at the start, the footer at the end is cleared separately.
+static size_t dirty_size(arena_t *arena, chunk_t *chunk) {
+	void *payload = (void *)chunk + sizeof(chunk_t);
+	size_t size = chunk_size(chunk) - OVERHEAD;
+	if (chunk < arena->first_chunk || chunk >= arena->last_chunk || arena->zero >= payload + size) return size;
+	if (arena->zero <= payload + sizeof(tree_t)) return sizeof(tree_t);
+	return arena->zero - payload;
+}
+
+// Mark the chunk as free, coalesce it with its neighbours and bin the result.
+// The caller holds the lock of the arena.
+static void release(arena_t *arena, chunk_t *chunk) {
+	size_t size = chunk_size(chunk);
+	chunk_t *next = next_chunk(chunk);
+	
+	// Coalesce to the left
+	if (!(chunk->head & PREV_INUSE)) {
+		if (conf.check && (chunk->prev_size < MIN_CHUNK || chunk_size(prev_chunk(chunk)) != chunk->prev_size)) {
+			check_fail("corrupted size of the chunk before", (void *)chunk + sizeof(chunk_t));
+		}
+		chunk = prev_chunk(chunk);
+		bin_remove(arena, chunk);
+		size += chunk_size(chunk);
+	}
+	// Coalesce to the right
+	if (is_free(next)) {
+		bin_remove(arena, next);
+		mark_dirty(arena, next, FREE_HEADER);
+		size += chunk_size(next);
+		next = next_chunk(next);
+	}
+	chunk->head = size | PREV_INUSE; // Both neighbours of a free chunk are in use
+	next->prev_size = size;
+	next->head &= ~PREV_INUSE;
+	bin_insert(arena, chunk);
+
+	if (next == arena->last_chunk && size >= conf.trim_threshold && !background_running) trim_top(arena, conf.top_pad);
+}
+
+// Put a freed small chunk aside without touching its neighbours.
+// It stays marked in use, so nothing coalesces with it until consolidate() releases the lot.
+static void defer(arena_t *arena, chunk_t *chunk) {
+	size_t index = bin_index(chunk_size(chunk));
+	links(chunk)->fd = arena->deferred[index];
+	arena->deferred[index] = chunk;
+	arena->stats.deferred += chunk_size(chunk);
+	if (arena->stats.deferred >= conf.defer) consolidate(arena);
+}
+
+// Coalesce and bin every deferred chunk, returns whether there were any.
+// The caller holds the lock of the arena.
+static bool consolidate(arena_t *arena) {
+	if (!arena->stats.deferred) return false;
+	for (size_t index = 0; index < NSMALLBINS; index++) {
+		for (chunk_t *chunk = arena->deferred[index], *next; chunk != NULL; chunk = next) {
+			next = links(chunk)->fd;
+			release(arena, chunk);
+		}
+		arena->deferred[index] = NULL;
+	}
+	arena->stats.deferred = 0;
+	return true;
+}
+
+static bool is_slab(void *ptr) {
+	return (uintptr_t)ptr - (uintptr_t)slab_base < slab_space;
+}
+
+static slab_t *slab_of(void *ptr) {
+	return (slab_t *)((uintptr_t)ptr & ~(pagesize - 1));
+}
+
+// Return the arena a pointer handed out by alloc() belongs to
+static arena_t *owner(void *ptr) {
+	if (is_slab(ptr)) return slab_of(ptr)->arena;
+	return arena_of(chunk_of(ptr));
+}
+
+// A chunk's payload runs into the prev_size word of the next chunk, except for mapped ones, which have none
+static size_t usable_size(void *ptr) {
+	if (is_slab(ptr)) return slab_of(ptr)->size;
+	chunk_t *chunk = chunk_of(ptr);
+	if (is_guarded(chunk)) return chunk_size(chunk) - chunk->prev_size - sizeof(chunk_t) - pagesize;
+	if (chunk->head & MMAPPED) return chunk_size(chunk) - chunk->prev_size - sizeof(chunk_t);
+	return chunk_size(chunk) - OVERHEAD;
+}
+
+// Fit as many objects of every class into a page as the header and its bitmap leave room for
+static void slab_layout() {
+	for (size_t class = 0; class < NSLABCLASSES; class++) {
+		size_t size = (class + 1) * ALIGNMENT;
+		size_t nslots = (pagesize - sizeof(slab_t)) / size;
+		size_t offset;
+		for (;; nslots--) {
+			offset = (sizeof(slab_t) + (nslots + 63) / 64 * sizeof(uint64_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+			if (offset + nslots * size <= pagesize) break;
+		}
+		slab_slots[class] = nslots;
+		slab_offset[class] = offset;
+	}
+}
+
+// Take a page from the slab reservation and set it up as an empty slab of the arena.
+// The caller holds the lock of the arena.
+static slab_t *slab_create(arena_t *arena, size_t class) {
+	slab_t *slab = NULL;
+
+	lock_acquire(&slab_lock);
+	if (slab_pages) {
+		slab = slab_pages;
+		slab_pages = *(void **)slab_pages;
+	}
+	else if (slab_npurged) {
+		size_t word = 0;
+		while (!slab_purged[word]) word++;
+		size_t page = word * 64 + __builtin_ctzll(slab_purged[word]);
+		slab_purged[word] &= slab_purged[word] - 1;
+		slab_npurged--;
+		slab = slab_base + page * pagesize;
+	}
+	else if (slab_top < slab_base + slab_space) {
+		if (slab_top == slab_committed) {
+			size_t commit = SLAB_COMMIT * pagesize > grow_unit ? SLAB_COMMIT * pagesize : grow_unit;
+			if (mprotect(slab_committed, commit, PROT_READ | PROT_WRITE) == 0) slab_committed += commit;
+		}
+		if (slab_top < slab_committed) {
+			slab = slab_top;
+			slab_top += pagesize;
+		}
+	}
+	lock_release(&slab_lock);
+	if (!slab) return NULL;
+
+	// Writing the header here places a fresh page on the node of the arena's threads
+	arena->stats.slab_pages += pagesize;
+	slab->arena = arena;
+	slab->size = (class + 1) * ALIGNMENT;
+	slab->nslots = slab->nfree = slab_slots[class];
+	memset(slab->bitmap, 0, (slab->nslots + 63) / 64 * sizeof(uint64_t));
+	for (size_t i = 0; i < slab->nslots; i++) slab->bitmap[i / 64] |= 1ULL << (i % 64);
+
+	slab->prev = NULL;
+	slab->next = arena->slabs[class];
+	if (slab->next) slab->next->prev = slab;
+	arena->slabs[class] = slab;
+	return slab;
+}
+
+// The caller holds the lock of the arena
+static void *slab_alloc(arena_t *arena, size_t size) {
+	size_t class = size / ALIGNMENT - 1;
+	slab_t *slab = arena->slabs[class];
+	if (!slab && !(slab = slab_create(arena, class))) return NULL;
+
+	size_t word = 0, slot;
+	if (conf.check) {
+		// A random free slot, so that an overflow cannot count on what lies next to its object
+		check_random ^= check_random ? check_random << 13 : check_secret + (uintptr_t)&check_random;
+		check_random ^= check_random >> 7;
+		check_random ^= check_random << 17;
+		size_t nwords = (slab->nslots + 63) / 64;
+		word = check_random % nwords;
+		while (!slab->bitmap[word]) word = (word + 1) % nwords;
+		unsigned shift = check_random >> 58;
+		uint64_t bits = slab->bitmap[word] >> shift | slab->bitmap[word] << (-shift & 63);
+		slot = word * 64 + ((__builtin_ctzll(bits) + shift) & 63);
+		slab->bitmap[word] &= ~(1ULL << (slot % 64));
+	}
+	else {
+		while (!slab->bitmap[word]) word++;
+		slot = word * 64 + __builtin_ctzll(slab->bitmap[word]);
+		slab->bitmap[word] &= slab->bitmap[word] - 1;
+	}
+
+	// A full slab leaves the list, it comes back when one of its objects is freed
+	if (--slab->nfree == 0) {
+		arena->slabs[class] = slab->next;
+		if (slab->next) slab->next->prev = NULL;
+	}
+	arena->stats.slab_used += slab->size;
+	return (void *)slab + slab_offset[class] + slot * slab->size;
+}
+
+// The caller holds the lock of the arena
+static void slab_release(arena_t *arena, slab_t *slab, void *ptr) {
+	size_t class = slab->size / ALIGNMENT - 1;
+	size_t slot = (ptr - (void *)slab - slab_offset[class]) / slab->size;
+	if (conf.check && (slab->bitmap[slot / 64] & 1ULL << (slot % 64))) check_fail("double free", ptr);
+	slab->bitmap[slot / 64] |= 1ULL << (slot % 64);
+	arena->stats.slab_used -= slab->size;
+
+	if (slab->nfree++ == 0) {
+		slab->prev = NULL;
+		slab->next = arena->slabs[class];
+		if (slab->next) slab->next->prev = slab;
+		arena->slabs[class] = slab;
+	}
+	// Keep one empty slab per class around, hand the others back
+	else if (slab->nfree == slab->nslots && (slab->prev || slab->next)) {
+		if (slab->prev) slab->prev->next = slab->next;
+		else arena->slabs[class] = slab->next;
+		if (slab->next) slab->next->prev = slab->prev;
+
+		arena->stats.slab_pages -= pagesize;
+		lock_acquire(&slab_lock);
+		*(void **)slab = slab_pages;
+		slab_pages = slab;
+		lock_release(&slab_lock);
+	}
+}
+
+// Give the pages of empty slabs back to the OS.
+// They can no longer hold the list link, so they are tracked in a bitmap from here on.
+static bool slab_purge() {
+	bool released = false;
+	if (conf.hugepages != HUGEPAGES_OFF) return false; // Single pages would break up the huge ones
+	lock_acquire(&slab_lock);
+	for (void *page = slab_pages, *next; page != NULL; page = next) {
+		next = *(void **)page;
+		madvise(page, pagesize, MADV_DONTNEED);
+		size_t index = (page - slab_base) / pagesize;
+		slab_purged[index / 64] |= 1ULL << (index % 64);
+		slab_npurged++;
+		released = true;
+	}
+	slab_pages = NULL;
+	lock_release(&slab_lock);
+	return released;
+}
+
+// Free a slab object or a chunk, the caller holds the lock of its arena
+static void release_ptr(arena_t *arena, void *ptr) {
+	if (conf.stats) arena->stats.frees++;
+	if (is_slab(ptr)) slab_release(arena, slab_of(ptr), ptr);
+	else if (conf.defer && chunk_size(chunk_of(ptr)) <= MAX_SMALL) defer(arena, chunk_of(ptr));
+	else release(arena, chunk_of(ptr));
+}
+
+// Free a pointer into an arena some other thread allocates from, without waiting for its lock.
+// Any number of threads push, only the holder of the lock takes the whole list at once, so there is no ABA.
+static void remote_push(arena_t *arena, void *ptr) {
+	void *head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+	do *(void **)ptr = head;
+	while (!__atomic_compare_exchange_n(&arena->remote, &head, ptr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Release what other threads freed into the arena, the caller holds its lock
+static void remote_drain(arena_t *arena) {
+	void *ptr = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+	for (void *next; ptr != NULL; ptr = next) {
+		next = *(void **)ptr;
+		release_ptr(arena, ptr);
+		if (conf.stats) arena->stats.remote++;
+	}
+}
+
+// Large allocations get a mapping of their own, which goes back to the OS on free().
+// To align the payload the chunk can start further into the mapping, prev_size holds how far,
+// and the size of the chunk is that of the whole mapping.
+static void *map_chunk(size_t alignment, size_t size) {
+	size_t slack = alignment > ALIGNMENT ? alignment : 0;
+	size_t length = (size + sizeof(chunk_t) + slack + pagesize - 1) & ~(pagesize - 1);
+	void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) return NULL;
+
+	// Hand back the pages on both sides that the aligned chunk does not need
+	void *payload = (void *)(((uintptr_t)map + sizeof(chunk_t) + alignment - 1) & ~(alignment - 1));
+	chunk_t *chunk = payload - sizeof(chunk_t);
+	void *start = (void *)((uintptr_t)chunk & ~(pagesize - 1));
+	void *end = (void *)(((uintptr_t)payload + size + pagesize - 1) & ~(pagesize - 1));
+	if (start != map) munmap(map, start - map);
+	if (end != map + length) munmap(end, map + length - end);
+	if (conf.hugepages != HUGEPAGES_OFF && end - start >= HUGE_PAGE) madvise(start, end - start, MADV_HUGEPAGE);
+
+	chunk->prev_size = (void *)chunk - start;
+	chunk->head = (end - start) | INUSE | MMAPPED;
+	map_add(1, end - start);
+	if (conf.stats) __atomic_add_fetch(&mapped_allocs, 1, __ATOMIC_RELAXED);
+	return payload;
+}
+
+static void unmap_chunk(chunk_t *chunk) {
+	map_add(-1, -chunk_size(chunk));
+	if (is_guarded(chunk) && conf.quarantine) {
+		quarantine(chunk);
+		return;
+	}
+	munmap((void *)chunk - chunk->prev_size, chunk_size(chunk));
+}
+
+// Resize the mapping, letting the kernel move the pages instead of copying them.
+// A move keeps the offset into the page, and so the offset of the chunk into the mapping.
+static void *remap_chunk(chunk_t *chunk, size_t size) {
+	size_t offset = chunk->prev_size;
+	size_t old = chunk_size(chunk);
+	size_t length = (offset + sizeof(chunk_t) + size + pagesize - 1) & ~(pagesize - 1);
+	if (length != old) {
+		void *map = mremap((void *)chunk - offset, old, length, MREMAP_MAYMOVE);
+		if (map == MAP_FAILED) return length <= old ? (void *)chunk + sizeof(chunk_t) : NULL;
+		map_add(0, length - old);
+		chunk = map + offset;
+		chunk->head = length | INUSE | MMAPPED;
+	}
+	return (void *)chunk + sizeof(chunk_t);
+}
+
+static bool is_guarded(chunk_t *chunk) {
+	return (chunk->head & (MMAPPED | GUARDED)) == (MMAPPED | GUARDED);
+}
+
+// A mapped chunk whose payload ends where a PROT_NONE page starts, so that an overflow faults right away.
+// Only the rounding of the size up to ALIGNMENT stays unguarded.
+static void *guard_chunk(size_t alignment, size_t size) {
+	size_t slack = alignment > ALIGNMENT ? alignment : 0;
+	size_t length = ((size + sizeof(chunk_t) + slack + pagesize - 1) & ~(pagesize - 1)) + pagesize;
+	void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) return NULL;
+	void *guard = map + length - pagesize;
+	if (mprotect(guard, pagesize, PROT_NONE) != 0) {
+		munmap(map, length);
+		return NULL;
+	}
+
+	void *payload = (void *)((uintptr_t)(guard - size) & ~(alignment - 1));
+	chunk_t *chunk = payload - sizeof(chunk_t);
+	chunk->prev_size = (void *)chunk - map;
+	chunk->head = length | INUSE | MMAPPED | GUARDED;
+	map_add(1, length);
+	if (conf.stats) __atomic_add_fetch(&mapped_allocs, 1, __ATOMIC_RELAXED);
+	return payload;
+}
+
+// The pages of a freed guarded chunk are dropped but its address space stays reserved and inaccessible,
+// so a use after free() faults until the chunk leaves the quarantine, oldest first.
+static void quarantine(chunk_t *chunk) {
+	void *map = (void *)chunk - chunk->prev_size;
+	size_t length = chunk_size(chunk);
+	if (mmap(map, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+		munmap(map, length);
+		return;
+	}
+
+	lock_acquire(&quarantine_lock);
+	while (quarantine_count && (quarantine_count == QUARANTINE_SLOTS || quarantine_bytes + length > conf.quarantine)) {
+		munmap(quarantine_maps[quarantine_first], quarantine_lengths[quarantine_first]);
+		quarantine_bytes -= quarantine_lengths[quarantine_first];
+		quarantine_first = (quarantine_first + 1) % QUARANTINE_SLOTS;
+		quarantine_count--;
+	}
+	size_t slot = (quarantine_first + quarantine_count) % QUARANTINE_SLOTS;
+	quarantine_maps[slot] = map;
+	quarantine_lengths[slot] = length;
+	quarantine_count++;
+	quarantine_bytes += length;
+	lock_release(&quarantine_lock);
+}
+
+static void tcache_create_key() {
+	if (pthread_key_create(&tcache_key, tcache_drain) != 0) {
+		perror("pthread_key_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Called on the first malloc() of every thread.
+// The key is only there so that the cache is drained when the thread exits.
+static void tcache_init() {
+	if (booting) return; // init() is running on this thread, the cache waits for the first allocation after it
+	tcache.state = TCACHE_DISABLED; // Allocations made from here on take the locked path
+	pthread_once(&init_once, init); // For the settings and the list of caches
+	if (!conf.tcache_count) return; // Caching is turned off
+	pthread_once(&tcache_once, tcache_create_key);
+	if (pthread_setspecific(tcache_key, &tcache) != 0) return;
+	for (size_t index = 0; index < NSMALLBINS; index++) tcache.limits[index] = TCACHE_START < conf.tcache_count ? TCACHE_START : conf.tcache_count;
+	tcache.ticks = TCACHE_GC;
+
+	lock_acquire(&stats_lock);
+	tcache.prev = NULL;
+	tcache.next = tcaches;
+	if (tcaches) tcaches->prev = &tcache;
+	tcaches = &tcache;
+	lock_release(&stats_lock);
+	tcache.state = TCACHE_ACTIVE;
+}
+
+// Hand the oldest n chunks cached for a size class back to the arenas they came from.
+// Consecutive chunks of the thread's own arena are released under one lock, the others go on remote lists.
+static void tcache_spill(size_t index, size_t n) {
+	void **link = &tcache.entries[index];
+	for (size_t i = n; i < tcache.counts[index]; i++) link = (void **)*link;
+
+	arena_t *locked = NULL;
+	for (void *ptr = *link, *next; ptr != NULL; ptr = next) {
+		next = *(void **)ptr;
+		arena_t *arena = owner(ptr);
+		if (arena != thread_arena) {
+			remote_push(arena, ptr);
+			continue;
+		}
+		if (arena != locked) {
+			if (locked) arena_unlock(locked);
+			arena_lock(arena);
+			locked = arena;
+		}
+		release_ptr(arena, ptr);
+	}
+	if (locked) arena_unlock(locked);
+
+	*link = NULL;
+	tcache.counts[index] -= n;
+	if (tcache.low[index] > tcache.counts[index]) tcache.low[index] = tcache.counts[index];
+}
+
+// Classes that ran dry since the last pass get room for twice as many chunks.
+// Those that never touched some of their chunks give half of them back and make do with half the room,
+// so the cache of a thread shrinks with what it stops using.
+// A pass that tcache_scavenge() asked for empties the cache first.
+static void tcache_gc() {
+	tcache.ticks = TCACHE_GC;
+	bool flush = __atomic_exchange_n(&tcache.flush, false, __ATOMIC_RELAXED);
+	for (size_t index = 0; index < NSMALLBINS; index++) {
+		if (flush && tcache.counts[index]) tcache_spill(index, tcache.counts[index]);
+		if (tcache.misses[index]) {
+			size_t limit = 2 * tcache.limits[index];
+			tcache.limits[index] = limit < conf.tcache_count ? limit : conf.tcache_count;
+		}
+		else if (tcache.low[index]) {
+			tcache_spill(index, (tcache.low[index] + 1) / 2);
+			if (tcache.limits[index] > 1) tcache.limits[index] /= 2;
+		}
+		tcache.low[index] = tcache.counts[index];
+		tcache.misses[index] = 0;
+	}
+}
+
+// Have the caches of other threads flushed by their next operation, all of them or those that went unused since the last call.
+// A thread that never allocates or frees again keeps its cache, taking it would need an atomic fast path.
+static void tcache_scavenge(bool idle) {
+	lock_acquire(&stats_lock); // Keeps the caches from being drained meanwhile
+	for (tcache_t *tc = tcaches; tc != NULL; tc = tc->next) {
+		uint32_t ticks = __atomic_load_n(&tc->ticks, __ATOMIC_RELAXED);
+		if (!idle || ticks == tc->seen) {
+			__atomic_store_n(&tc->flush, true, __ATOMIC_RELAXED);
+			__atomic_store_n(&tc->ticks, 1, __ATOMIC_RELAXED);
+			ticks = 1;
+		}
+		tc->seen = ticks;
+	}
+	lock_release(&stats_lock);
+}
+
+// pthread key destructor, return everything the exiting thread has cached
+static void tcache_drain(void *arg) {
+	tcache_t *tc = arg;
+	tc->state = TCACHE_DISABLED;
+	for (size_t index = 0; index < NSMALLBINS; index++) {
+		if (tc->counts[index]) tcache_spill(index, tc->counts[index]);
+	}
+
+	lock_acquire(&stats_lock);
+	if (tc->prev) tc->prev->next = tc->next;
+	else tcaches = tc->next;
+	if (tc->next) tc->next->prev = tc->prev;
+	for (size_t index = 0; index < NSMALLBINS; index++) retired_hits[index] += tc->hits[index];
+	retired_puts += tc->puts;
+	lock_release(&stats_lock);
+}
+
+// Passing zero clears the memory, skipping what is known to be zero already.
+// Alignment is a power of two, and none of the caches hold anything aligned beyond ALIGNMENT.
+static void *allocate(size_t alignment, size_t size, bool zero) {
+	if (size > PTRDIFF_MAX || alignment > PTRDIFF_MAX - size) return NULL;
+	if (alignment < ALIGNMENT) alignment = ALIGNMENT;
+	size_t chunk_request = request_size(size);
+	size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); // Align the size to ALIGNMENT bytes
+	if (size < ALIGNMENT) size = ALIGNMENT;
+
+	// Fresh pages are zero
+	if (conf.guard && guard_countdown-- == 0) {
+		guard_countdown = conf.guard - 1;
+		void *addr = guard_chunk(alignment, size);
+		if (addr) return addr;
+	}
+
+	if (alignment == ALIGNMENT && size <= MAX_SMALL) {
+		if (tcache.state == TCACHE_UNINIT) tcache_init();
+		size_t index = bin_index(size);
+		void *addr = tcache.entries[index];
+		if (addr) {
+			if (conf.check) {
+				if ((uintptr_t)*(void **)addr & (ALIGNMENT - 1)) check_fail("corrupted thread cache", addr);
+				((uint64_t *)addr)[1] = 0;
+			}
+			tcache.entries[index] = *(void **)addr;
+			if (--tcache.counts[index] < tcache.low[index]) tcache.low[index] = tcache.counts[index];
+			if (conf.stats) tcache.hits[index]++;
+			if (--tcache.ticks == 0) tcache_gc();
+			if (zero) memset(addr, 0, size);
+			return addr;
+		}
+		if (tcache.state == TCACHE_ACTIVE) {
+			if (tcache.misses[index] < UINT16_MAX) tcache.misses[index]++;
+			if (--tcache.ticks == 0) tcache_gc();
+		}
+	}
+
+	// Nothing is cached while booting, tcache_init() leaves the cache empty until init() is done
+	if (booting) return boot_alloc(alignment, size); // The boot heap is never reused, so it is still zero
+	if (background_pending) background_start();
+	arena_t *arena = arena_get();
+	if (size >= conf.mmap_threshold || (alignment > ALIGNMENT && size + alignment >= conf.mmap_threshold)) {
+		void *addr = map_chunk(alignment, size); // Fresh pages are zero
+		if (addr) return addr;
+	}
+
+	// Carve the aligned chunk out of a larger one
+	if (alignment > ALIGNMENT) chunk_request += alignment + MIN_CHUNK;
+
+	// Segments cannot hold everything, the sbrk() heap can
+	if (chunk_request > SEGMENT_SIZE / 2) arena = &arenas[0];
+
+	arena_lock(arena);
+	if (conf.stats) arena->stats.mallocs[bin_index(size)]++;
+	if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED)) remote_drain(arena);
+
+	chunk_t *chunk;
+	void *addr = NULL;
+	size_t dirty = size;
+
+	if (alignment == ALIGNMENT && size <= SLAB_MAX && (addr = slab_alloc(arena, size))) {
+		arena_unlock(arena);
+		if (zero) memset(addr, 0, size);
+		return addr;
+	}
+
+	// A deferred chunk of the exact size is ready as it is
+	if (conf.defer && alignment == ALIGNMENT && chunk_request <= MAX_SMALL && (chunk = arena->deferred[bin_index(chunk_request)])) {
+		arena->deferred[bin_index(chunk_request)] = links(chunk)->fd;
+		arena->stats.deferred -= chunk_request;
+		arena_unlock(arena);
+		addr = (void *)chunk + sizeof(chunk_t);
+		if (zero) memset(addr, 0, chunk_request - OVERHEAD);
+		return addr;
+	}
+
+	chunk = best_fit(arena, chunk_request);
+	if (!chunk && consolidate(arena)) chunk = best_fit(arena, chunk_request);
+	if (!chunk) chunk = extend(arena, chunk_request);
+	
+	if (chunk) {
+		bin_remove(arena, chunk);
+		chunk->head |= INUSE;
+		next_chunk(chunk)->head |= PREV_INUSE;
+		if (alignment > ALIGNMENT) {
+			chunk = align_chunk(arena, chunk, alignment);
+			chunk_request = request_size(size);
+		}
+		crop(arena, chunk, chunk_request);
+		addr = (void *)chunk + sizeof(chunk_t);
+		if (zero) {
+			dirty = dirty_size(arena, chunk);
+			*(size_t *)((void *)chunk + chunk_size(chunk)) = 0; // The footer it had while free
+		}
+		mark_dirty(arena, chunk, chunk_size(chunk) + OVERHEAD);
+	}
+	
+	arena_unlock(arena);
+	if (addr && zero) memset(addr, 0, dirty < size ? dirty : size);
+	return addr;
+}
+
+// A bump allocator with a header like a chunk's, so usable_size() and the checks work unchanged.
+// The payload runs into the next header's prev_size word, as in the heap. Boot memory is never freed.
+static void *boot_alloc(size_t alignment, size_t size) {
+	uintptr_t base = (uintptr_t)boot_heap;
+	size_t offset = ((base + boot_used + sizeof(chunk_t) + alignment - 1) & ~(alignment - 1)) - base;
+	if (offset > BOOT_HEAP || BOOT_HEAP - offset < size + OVERHEAD) return NULL;
+	chunk_t *chunk = (chunk_t *)(boot_heap + offset - sizeof(chunk_t));
+	chunk->head = (size + sizeof(chunk_t)) | INUSE;
+	boot_used = offset + size;
+	return boot_heap + offset;
+}
+
+static bool is_boot(void *ptr) {
+	return (uintptr_t)ptr - (uintptr_t)boot_heap < BOOT_HEAP;
+}
+
+// Every allocation counts down the bytes to the next sample of the profiler
+static void *alloc(size_t alignment, size_t size, bool zero) {
+	void *addr = allocate(alignment, size, zero);
+	if (conf.check && addr) check_stamp(addr);
+	if (conf.prof_rate && addr && (prof_countdown -= size) < 0) prof_sample(addr, size);
+	if (conf.trace && !trace_inner) {
+		if (alignment > ALIGNMENT) trace('a', alignment, size, addr);
+		else trace(zero ? 'c' : 'm', size, 0, addr);
+	}
+	return addr;
+}
+
+void *malloc(size_t size) {
+	void *addr = alloc(ALIGNMENT, size, false);
+#ifdef DEBUG
+	fprintf(stderr, "malloc(%d)", size);
+	fprintf(stderr, " = %p\n", addr);
+#endif
+	return addr;
+}
+
+
+void free(void *ptr) {
+#ifdef DEBUG
+	fprintf(stderr, "free(%p)\n", ptr);
+#endif
+	if (!ptr) return;
+	if (conf.prof_rate) prof_forget(ptr);
+	if (conf.trace && !trace_inner) trace('f', 0, 0, ptr);
+
+	size_t size;
+	if (is_slab(ptr)) size = slab_of(ptr)->size;
+	else {
+		if (is_region(ptr) || is_boot(ptr)) return; // Goes when its region is reset, boot memory never does
+		if (conf.check) check_free(ptr);
+		chunk_t *chunk = chunk_of(ptr);
+		if (chunk->head & MMAPPED) {
+			if (!(chunk->head & REGION)) unmap_chunk(chunk);
+			return;
+		}
+		size = chunk_size(chunk) - OVERHEAD;
+	}
+	dealloc(ptr, size);
+}
+
+// The caller knows the size, so a slab object goes to the cache without touching the page header.
+// Anything else needs its header anyway.
+void free_sized(void *ptr, size_t size) {
+#ifdef DEBUG
+	fprintf(stderr, "free_sized(%p, %d)\n", ptr, size);
+#endif
+	if (!ptr) return;
+	if (size <= SLAB_MAX && is_slab(ptr)) {
+		if (conf.prof_rate) prof_forget(ptr);
+		if (conf.trace && !trace_inner) trace('f', 0, 0, ptr);
+		size = size ? (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1) : ALIGNMENT; // The class it was allocated from
+		dealloc(ptr, size);
+		return;
+	}
+	free(ptr);
+}
 
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+	if (alignment <= ALIGNMENT) free_sized(ptr, size);
+	else free(ptr); // Never a slab object
+}
 
-static void print_chunk(chunk_t *chunk);
-static void print_heap();
-static void debug_heap();
-static chunk_t *extend(size_t);
-static chunk_t *best_fit(size_t, size_t);
-static void crop(chunk_t *, size_t);
-static void *alloc(size_t, size_t);
-void *malloc(size_t);
-void free(void *);
-void *calloc(size_t, size_t);
-void *realloc(void *, size_t);
-void *reallocarray(void *, size_t, size_t);
-size_t malloc_usable_size(void *);
-void *aligned_alloc(size_t, size_t);
-int posix_memalign(void **, size_t, size_t);
+// Put a non-mapped allocation of the given usable size into the cache, or back into its arena
+static void dealloc(void *ptr, size_t size) {
+	if (size <= MAX_SMALL && tcache.state == TCACHE_ACTIVE) {
+		size_t index = bin_index(size);
+		if (conf.check) check_cached(ptr, index);
+		if (tcache.counts[index] >= tcache.limits[index]) tcache_spill(index, (tcache.counts[index] + 1) / 2);
+		*(void **)ptr = tcache.entries[index];
+		tcache.entries[index] = ptr;
+		tcache.counts[index]++;
+		if (conf.stats) tcache.puts++;
+		if (--tcache.ticks == 0) tcache_gc();
+		return;
+	}
 
+	arena_t *arena = owner(ptr);
+	if (arena != thread_arena) {
+		remote_push(arena, ptr);
+		return;
+	}
+	arena_lock(arena);
+	release_ptr(arena, ptr);
+	arena_unlock(arena);
+}
 
-static void print_chunk(chunk_t *chunk) {
-	fprintf(stderr, "Addr: %p\n", chunk);
-	fprintf(stderr, "Size: %d\n", chunk->size);
-	fprintf(stderr, "Next: %p\n", chunk->next);
-	fprintf(stderr, "Prev: %p\n", chunk->prev);
-	fprintf(stderr, "Free: %b\n", chunk->free);
-	if (chunk->next) fprintf(stderr, "Data: %d bytes\n", (size_t)((void *)chunk->next - (void *)chunk) - sizeof(chunk_t));
-	else fprintf(stderr, "Data: %d bytes\n", (size_t)(sbrk(0) - (void *)chunk) - sizeof(chunk_t));
-	fprintf(stderr, "\n");
+// Split a chunk just taken out of its bin into at most n in-use chunks of size bytes.
+// The remainder is binned again. Returns how many were written to out.
+static size_t carve(arena_t *arena, chunk_t *chunk, size_t size, size_t n, void **out) {
+	chunk->head |= INUSE;
+	next_chunk(chunk)->head |= PREV_INUSE;
+	size_t count = chunk_size(chunk) / size;
+	if (count > n) count = n;
+
+	for (size_t i = 1; i < count; i++) {
+		chunk_t *new = (chunk_t *)((void *)chunk + size);
+		new->head = (chunk_size(chunk) - size) | INUSE | PREV_INUSE;
+		chunk->head = size | (chunk->head & FLAGS);
+		*out++ = (void *)chunk + sizeof(chunk_t);
+		chunk = new;
+	}
+	crop(arena, chunk, size);
+	*out = (void *)chunk + sizeof(chunk_t);
+	mark_dirty(arena, chunk, chunk_size(chunk) + OVERHEAD); // And everything carved before it
+	return count;
 }
 
-static void print_heap() {
-	for (chunk_t *chunk = first_chunk; chunk != NULL; chunk = chunk->next) print_chunk(chunk);
+// Every object is stamped, sampled and logged as if malloc() had returned it
+static void batch_track(void **out, size_t count, size_t size) {
+	for (size_t i = 0; i < count; i++) {
+		if (conf.check) check_stamp(out[i]);
+		if (conf.prof_rate && (prof_countdown -= size) < 0) prof_sample(out[i], size);
+		if (conf.trace) trace('m', size, 0, out[i]);
+	}
 }
 
-// Walk the chunks and look for discrepancies between size and pointers
-static void debug_heap() {
-	for (chunk_t *chunk = first_chunk; chunk->next != NULL; chunk = chunk->next) {
-		if ((void *)chunk + chunk->size + sizeof(chunk_t) != (void *)chunk->next) {
-			fprintf(stderr, "Error, misaligned chunk and chunk->next!\n");
-			print_chunk(chunk);
-			print_chunk(chunk->next);
-			fprintf(stderr, "First chunk: %p\n", first_chunk);
-			fprintf(stderr, "Last chunk: %p\n", last_chunk);
-			exit(EXIT_FAILURE);
+size_t qalloc_batch_malloc(size_t size, size_t n, void **out) {
+#ifdef DEBUG
+	fprintf(stderr, "qalloc_batch_malloc(%d, %d, %p)\n", size, n, out);
+#endif
+	if (size > PTRDIFF_MAX) return 0;
+	size_t count = 0;
+	if (conf.guard) {
+		// Every object has to pass the countdown, one at a time
+		while (count < n && (out[count] = alloc(ALIGNMENT, size, false))) count++;
+		return count;
+	}
+	size_t request = size;
+	size_t chunk_request = request_size(size);
+	size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); // Align the size to ALIGNMENT bytes
+	if (size < ALIGNMENT) size = ALIGNMENT;
+
+	arena_t *arena = arena_get();
+	if (size >= conf.mmap_threshold) {
+		while (count < n && (out[count] = map_chunk(ALIGNMENT, size))) count++;
+		batch_track(out, count, request);
+		return count;
+	}
+	if (chunk_request > SEGMENT_SIZE / 2) arena = &arenas[0];
+
+	// Ask for one region that holds them all, as far as a segment can
+	size_t most = SEGMENT_SIZE / 2 / chunk_request;
+	if (!most) most = 1;
+
+	arena_lock(arena);
+	if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED)) remote_drain(arena);
+	if (size <= SLAB_MAX) {
+		while (count < n && (out[count] = slab_alloc(arena, size))) count++;
+	}
+	while (count < n) {
+		size_t want = n - count < most ? n - count : most;
+		chunk_t *chunk = best_fit(arena, want * chunk_request);
+		if (!chunk && consolidate(arena)) chunk = best_fit(arena, want * chunk_request);
+		if (!chunk) chunk = extend(arena, want * chunk_request);
+		if (!chunk) chunk = best_fit(arena, chunk_request); // Take them a few at a time
+		if (!chunk) break;
+		bin_remove(arena, chunk);
+		count += carve(arena, chunk, chunk_request, want, out + count);
+	}
+	if (conf.stats) arena->stats.mallocs[bin_index(size)] += count;
+	arena_unlock(arena);
+	batch_track(out, count, request);
+	return count;
+}
+
+static int address_order(const void *a, const void *b) {
+	uintptr_t x = *(uintptr_t *)a, y = *(uintptr_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Chunks that are next to each other in memory are joined while still in use,
+// so that each run is coalesced and binned once
+void qalloc_batch_free(void **ptrs, size_t n) {
+#ifdef DEBUG
+	fprintf(stderr, "qalloc_batch_free(%p, %d)\n", ptrs, n);
+#endif
+	qsort(ptrs, n, sizeof(void *), address_order); // Before any lock, it may allocate
+
+	arena_t *locked = NULL;
+	for (size_t i = 0; i < n; i++) {
+		void *ptr = ptrs[i];
+		if (!ptr) continue;
+		if (conf.prof_rate) prof_forget(ptr);
+		if (conf.trace) trace('f', 0, 0, ptr);
+		if (is_region(ptr) || is_boot(ptr)) continue;
+		if (conf.check && !is_slab(ptr)) check_free(ptr);
+		if (!is_slab(ptr) && (chunk_of(ptr)->head & MMAPPED)) {
+			if (!(chunk_of(ptr)->head & REGION)) unmap_chunk(chunk_of(ptr));
+			continue;
 		}
+
+		arena_t *arena = owner(ptr);
+		if (arena != thread_arena) {
+			remote_push(arena, ptr);
+			continue;
+		}
+		if (arena != locked) {
+			if (locked) arena_unlock(locked);
+			arena_lock(arena);
+			locked = arena;
+		}
+		if (is_slab(ptr)) {
+			release_ptr(arena, ptr);
+			continue;
+		}
+
+		chunk_t *chunk = chunk_of(ptr);
+		size_t size = chunk_size(chunk), run = 1;
+		while (i + 1 < n && ptrs[i + 1] && (void *)chunk + size == (void *)chunk_of(ptrs[i + 1])) {
+			i++;
+			if (conf.prof_rate) prof_forget(ptrs[i]);
+			if (conf.trace) trace('f', 0, 0, ptrs[i]);
+			if (conf.check) check_free(ptrs[i]);
+			size += chunk_size(chunk_of(ptrs[i]));
+			run++;
+		}
+		chunk->head = size | (chunk->head & FLAGS);
+		if (conf.stats) arena->stats.frees += run - 1;
+		release_ptr(arena, ptr);
 	}
-	for (chunk_t *chunk = last_chunk; chunk != first_chunk; chunk = chunk->prev) {
-		if ((void *)chunk - chunk->prev->size - sizeof(chunk_t) != (void *)chunk->prev) {
-			fprintf(stderr, "Error, misaligned chunk and chunk->prev!\n");
-			print_chunk(chunk);
-			print_chunk(chunk->prev);
-			fprintf(stderr, "First chunk: %p\n", first_chunk);
-			fprintf(stderr, "Last chunk: %p\n", last_chunk);
-			exit(EXIT_FAILURE);
+	if (locked) arena_unlock(locked);
+}
+
+static bool is_region(void *ptr) {
+	return (uintptr_t)ptr - (uintptr_t)region_base < region_space;
+}
+
+// The bytes from ptr to the end of its block, an object of the region cannot be any larger
+static size_t region_extent(void *ptr) {
+	return REGION_BLOCK - ((uintptr_t)(ptr - region_base) & (REGION_BLOCK - 1));
+}
+
+// Take a block from the reservation, whose first word the caller links
+static void *region_block() {
+	void *block = NULL;
+
+	lock_acquire(&region_lock);
+	if (region_blocks) {
+		block = region_blocks;
+		region_blocks = *(void **)region_blocks;
+	}
+	else if (region_npurged) {
+		size_t word = 0;
+		while (!region_purged[word]) word++;
+		size_t index = word * 64 + __builtin_ctzll(region_purged[word]);
+		region_purged[word] &= region_purged[word] - 1;
+		region_npurged--;
+		block = region_base + index * REGION_BLOCK;
+	}
+	else if (region_top < region_base + region_space) {
+		if (mprotect(region_top, REGION_BLOCK, PROT_READ | PROT_WRITE) == 0) {
+			block = region_top;
+			region_top += REGION_BLOCK;
 		}
 	}
+	lock_release(&region_lock);
+	return block;
 }
 
+// Map a chunk for a large object and list it in the region.
+// The link takes the first ALIGNMENT bytes of the mapping, prev_size skips them like it skips alignment.
+static void *region_map(qalloc_region_t *region, size_t size) {
+	size_t length = (ALIGNMENT + sizeof(chunk_t) + size + pagesize - 1) & ~(pagesize - 1);
+	void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) return NULL;
 
-static void init() {
-	pagesize = sysconf(_SC_PAGESIZE);
-	size_t size;
-	void *start;
-	void *end;
+	chunk_t *chunk = map + ALIGNMENT;
+	chunk->prev_size = ALIGNMENT;
+	chunk->head = length | INUSE | MMAPPED | REGION;
+	*(chunk_t **)map = region->large;
+	region->large = chunk;
+	map_add(1, length);
+	if (conf.stats) __atomic_add_fetch(&mapped_allocs, 1, __ATOMIC_RELAXED);
+	return (void *)chunk + sizeof(chunk_t);
+}
 
-	pthread_mutexattr_t attr;
-	if (pthread_mutexattr_init(&attr) != 0) {
-		perror("pthread_mutexattr_init");
-		exit(EXIT_FAILURE);
+// Give the pages of free blocks back to the OS, tracking them in a bitmap from then on
+static bool region_purge() {
+	bool released = false;
+	if (conf.hugepages != HUGEPAGES_OFF) return false; // Would break up the huge pages
+	lock_acquire(&region_lock);
+	for (void *block = region_blocks, *next; block != NULL; block = next) {
+		next = *(void **)block;
+		madvise(block, REGION_BLOCK, MADV_DONTNEED);
+		size_t index = (block - region_base) / REGION_BLOCK;
+		region_purged[index / 64] |= 1ULL << (index % 64);
+		region_npurged++;
+		released = true;
 	}
-	if (pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL) != 0) {
-		perror("pthread_mutexattr_settype");
-		exit(EXIT_FAILURE);
+	region_blocks = NULL;
+	lock_release(&region_lock);
+	return released;
+}
+
+qalloc_region_t *qalloc_region_create() {
+	pthread_once(&init_once, init);
+	qalloc_region_t *region = region_block();
+	if (!region) return NULL;
+
+	region->next = NULL;
+	region->last = region;
+	region->top = (void *)region + ((sizeof(qalloc_region_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+	region->end = (void *)region + REGION_BLOCK;
+	region->large = NULL;
+#ifdef DEBUG
+	fprintf(stderr, "qalloc_region_create() = %p\n", region);
+#endif
+	return region;
+}
+
+void *qalloc_region_alloc(qalloc_region_t *region, size_t size) {
+	if (size > PTRDIFF_MAX) return NULL;
+	size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); // Align the size to ALIGNMENT bytes
+	if (size < ALIGNMENT) size = ALIGNMENT;
+	if (size > REGION_LARGE) return region_map(region, size);
+
+	// The rest of the current block is given up
+	if (size > (size_t)(region->end - region->top)) {
+		void *block = region_block();
+		if (!block) return NULL;
+		*(void **)block = NULL;
+		*(void **)region->last = block;
+		region->last = block;
+		region->top = block + ALIGNMENT;
+		region->end = block + REGION_BLOCK;
 	}
-	if (pthread_mutex_init(&mutex, &attr));
 
-	size = pagesize * INITIAL_SIZE;
+	void *addr = region->top;
+	region->top += size;
+	return addr;
+}
 
-	if ((start = (sbrk(size))) == (void *)-1) exit(EXIT_FAILURE);
-	end = start + size;
-	assert(end == sbrk(0));
+// Every block but the first goes back in one step, however many there are
+void qalloc_region_reset(qalloc_region_t *region) {
+#ifdef DEBUG
+	fprintf(stderr, "qalloc_region_reset(%p)\n", region);
+#endif
+	for (chunk_t *chunk = region->large, *next; chunk != NULL; chunk = next) {
+		next = *(chunk_t **)((void *)chunk - chunk->prev_size);
+		unmap_chunk(chunk);
+	}
+	region->large = NULL;
 
-	first_chunk = (chunk_t *)start;
-	first_chunk->size = size - 2 * sizeof(chunk_t);
-	first_chunk->next = (chunk_t *)(end - sizeof(chunk_t));
-	first_chunk->prev = NULL;
-	first_chunk->free = 1;
-	
-	last_chunk = first_chunk->next;
-	last_chunk->size = 0;
-	last_chunk->next = NULL;
-	last_chunk->prev = first_chunk;
-	last_chunk->free = 0;
+	if (region->next) {
+		lock_acquire(&region_lock);
+		*(void **)region->last = region_blocks;
+		region_blocks = region->next;
+		lock_release(&region_lock);
+		region->next = NULL;
+	}
+	region->last = region;
+	region->top = (void *)region + ((sizeof(qalloc_region_t) + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+	region->end = (void *)region + REGION_BLOCK;
 }
 
-static chunk_t *extend(size_t size) {
-	if (size < EXTEND_MIN * pagesize) size = EXTEND_MIN * pagesize;
-	size_t size_aligned = (size + sizeof(chunk_t) + pagesize - 1) & ~(pagesize - 1); // Align the size
-	
-	if (sbrk(size_aligned) == (void *)(-1)) return NULL;
+void qalloc_region_destroy(qalloc_region_t *region) {
+	qalloc_region_reset(region);
+	lock_acquire(&region_lock);
+	region->next = region_blocks;
+	region_blocks = region;
+	lock_release(&region_lock);
+}
+
+// Map the table of samples, an empty one costs no memory until samples are taken
+static void prof_init() {
+	void *map = mmap(NULL, PROF_SLOTS * (sizeof(void *) + sizeof(sample_t)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) {
+		conf.prof_rate = 0;
+		return;
+	}
+	prof_ptrs = map;
+	prof_samples = map + PROF_SLOTS * sizeof(void *);
 
-	last_chunk->size = size_aligned - sizeof(chunk_t);
-	last_chunk->next = (chunk_t *)((void *)last_chunk + last_chunk->size + sizeof(chunk_t));
-	last_chunk->free = 1;
-	last_chunk->next->prev = last_chunk;
-	last_chunk = last_chunk->next;
+	if (conf.prof_signal) {
+		struct sigaction action = { .sa_handler = prof_signal, .sa_flags = SA_RESTART };
+		sigemptyset(&action.sa_mask);
+		sigaction(conf.prof_signal, &action, NULL);
+	}
+}
 
-	last_chunk->size = 0;
-	last_chunk->next = NULL;
-	last_chunk->free = 0;
+// -ln of a uniform random number in (0, 1), which makes the gaps between samples exponential.
+// Without libm: ln x = (e + log2 m) ln 2 for x = m 2^e, and ln m from the atanh series.
+static double prof_exponential() {
+	if (!prof_random) prof_random = (uintptr_t)&prof_random * 0x9e3779b97f4a7c15ULL | 1;
+	prof_random ^= prof_random << 13;
+	prof_random ^= prof_random >> 7;
+	prof_random ^= prof_random << 17;
 
-	return last_chunk->prev;
+	union { double d; uint64_t u; } x = { .d = (double)((prof_random >> 11) | 1) / (1ULL << 53) };
+	int e = (int)(x.u >> 52) - 1023;
+	x.u = (x.u & ((1ULL << 52) - 1)) | (1023ULL << 52);
+	double t = (x.d - 1) / (x.d + 1), t2 = t * t;
+	double ln_m = 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7))));
+	return -(e * 0.6931471805599453 + ln_m);
 }
 
-// Return the smallest fitting chunk
-static chunk_t *best_fit(size_t alignment, size_t size) {
-	chunk_t *best = NULL;
-	for (chunk_t *chunk = first_chunk; chunk != NULL; chunk = chunk->next) {
-		if (chunk->size >= size && chunk->free && ((uintptr_t)chunk + sizeof(chunk_t)) % alignment == 0) {
-			if (!best) best = chunk;
-			else if (chunk->size < best->size) best = chunk;
+// The first slot of the line a pointer hashes to
+static size_t prof_slot(void *ptr) {
+	return ((uintptr_t)ptr * 0x9e3779b97f4a7c15ULL >> 32) & (PROF_SLOTS - 1) & ~(size_t)(PROF_LINE - 1);
+}
+
+// The end of the thread's stack, looked up once per thread.
+// That allocates, so a sample taken meanwhile gets no frames.
+static uintptr_t prof_stack() {
+	if (prof_stack_end) return prof_stack_end;
+	prof_stack_end = 1;
+	pthread_attr_t attr;
+	void *start;
+	size_t size;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0) return 1;
+	if (pthread_attr_getstack(&attr, &start, &size) == 0) prof_stack_end = (uintptr_t)start + size;
+	pthread_attr_destroy(&attr);
+	return prof_stack_end;
+}
+
+// Record the stack of a sampled allocation, walking the frame pointers, which release builds keep.
+// The frames of the allocator itself are left out, so the stack starts at its caller.
+// The walk stops at a frame that is not above the one before or not on the stack, code without frame pointers ends it early.
+static void prof_sample(void *ptr, size_t size) {
+	bool first = !prof_random; // Only starts the countdown of the thread
+	prof_countdown = (ssize_t)(prof_exponential() * conf.prof_rate) + 1;
+	if (first) return;
+	__atomic_add_fetch(&prof_allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&prof_bytes, size, __ATOMIC_RELAXED);
+
+	// Slots hold NULL while empty, 1 after a sample was removed and 2 while being written
+	size_t line = prof_slot(ptr), slot = line;
+	for (;; slot++) {
+		if (slot == line + PROF_LINE) {
+			__atomic_add_fetch(&prof_dropped, 1, __ATOMIC_RELAXED);
+			return;
 		}
+		void *old = __atomic_load_n(&prof_ptrs[slot], __ATOMIC_RELAXED);
+		if ((uintptr_t)old <= 1 && __atomic_compare_exchange_n(&prof_ptrs[slot], &old, (void *)2, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
 	}
-	return best;
+
+	sample_t *sample = &prof_samples[slot];
+	sample->size = size;
+	sample->depth = 0;
+	void **frame = __builtin_frame_address(0);
+	uintptr_t end = prof_stack();
+	while (sample->depth < PROF_DEPTH) {
+		void **next = frame[0];
+		char *ret = frame[1];
+		if (!ret) break;
+		if (sample->depth || ret < __ehdr_start || ret >= __etext) sample->stack[sample->depth++] = ret;
+		if (next <= frame || (uintptr_t)(next + 2) > end || ((uintptr_t)next & (sizeof(void *) - 1))) break;
+		frame = next;
+	}
+	__atomic_store_n(&prof_ptrs[slot], ptr, __ATOMIC_RELEASE);
 }
 
-// Crop the chunk to size.
-// A new free chunk is created out of the leftover space.
-// Passed size should be aligned to ALIGNMENT!
-static void crop(chunk_t *chunk, size_t size) {
-	ptrdiff_t leftover = chunk->size - size - sizeof(chunk_t);
+// Called on every free() while profiling, the line of the hash rules out almost every pointer
+static void prof_forget(void *ptr) {
+	size_t line = prof_slot(ptr);
+	for (size_t slot = line; slot < line + PROF_LINE; slot++) {
+		void *old = __atomic_load_n(&prof_ptrs[slot], __ATOMIC_RELAXED);
+		if (!old) return; // Slots are never emptied again, so a sample cannot sit past an empty one
+		if (old == ptr && __atomic_compare_exchange_n(&prof_ptrs[slot], &old, (void *)1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+	}
+}
 
-	if (leftover >= ALIGNMENT) {
-		chunk_t *new = (chunk_t *)((void *)chunk + sizeof(chunk_t) + size);
-		
-		new->size = leftover;
-		new->next = chunk->next;
-		new->prev = chunk;
-		new->free = 1;
+// Create qalloc.<pid>.<n>.<kind> in the working directory, leaving out n when it is negative
+static int out_open(out_t *out, const char *kind, ssize_t n) {
+	char name[64];
+	out->used = 0;
+	out_string(out, "qalloc.");
+	out_number(out, getpid(), 10);
+	out_string(out, ".");
+	if (n >= 0) {
+		out_number(out, n, 10);
+		out_string(out, ".");
+	}
+	out_string(out, kind);
+	memcpy(name, out->data, out->used);
+	name[out->used] = '\0';
+	out->used = 0;
+	return out->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
 
-		chunk->size = size;
-		chunk->next = new;
+static void out_flush(out_t *out) {
+	for (size_t done = 0; done < out->used;) {
+		ssize_t n = write(out->fd, out->data + done, out->used - done);
+		if (n <= 0) break;
+		done += n;
+	}
+	out->used = 0;
+}
 
-		new->next->prev = new;
+static void out_string(out_t *out, const char *string) {
+	for (; *string; string++) {
+		if (out->used == sizeof(out->data)) out_flush(out);
+		out->data[out->used++] = *string;
 	}
 }
 
-static void *alloc(size_t alignment, size_t size) {
-	size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); // Align the size to ALIGNMENT bytes
-	if (size > PTRDIFF_MAX) return NULL;
+static void out_number(out_t *out, size_t number, unsigned base) {
+	char digits[24];
+	size_t n = sizeof(digits);
+	digits[--n] = '\0';
+	do digits[--n] = "0123456789abcdef"[number % base];
+	while (number /= base);
+	out_string(out, digits + n);
+}
 
-	pthread_mutex_lock(&mutex);
-	if (!first_chunk) init();
+// Write the live samples as a gperftools heap profile, which pprof reads and scales by the rate,
+// to qalloc.<pid>.<n>.heap in the working directory. Only async-signal-safe calls from here on.
+static void prof_dump() {
+	out_t out;
+	if (out_open(&out, "heap", __atomic_fetch_add(&prof_dumps, 1, __ATOMIC_RELAXED)) < 0) return;
 
-	chunk_t *chunk;
-	void *addr = NULL;
+	size_t objects = 0, bytes = 0;
+	for (size_t slot = 0; slot < PROF_SLOTS; slot++) {
+		if ((uintptr_t)__atomic_load_n(&prof_ptrs[slot], __ATOMIC_ACQUIRE) <= 2) continue;
+		objects++;
+		bytes += prof_samples[slot].size;
+	}
+	out_string(&out, "heap profile: ");
+	out_number(&out, objects, 10);
+	out_string(&out, ": ");
+	out_number(&out, bytes, 10);
+	out_string(&out, " [");
+	out_number(&out, __atomic_load_n(&prof_allocs, __ATOMIC_RELAXED), 10);
+	out_string(&out, ": ");
+	out_number(&out, __atomic_load_n(&prof_bytes, __ATOMIC_RELAXED), 10);
+	out_string(&out, "] @ heap_v2/");
+	out_number(&out, conf.prof_rate, 10);
+	out_string(&out, "\n");
 
-	chunk = best_fit(alignment, size);
-	if (!chunk) chunk = extend(size);
-	
-	if (chunk) {
-		chunk->free = 0;
-		crop(chunk, size);
-		addr = (void *)chunk + sizeof(chunk_t);
+	// A sample freed and replaced while it is copied shows up as a change of the slot
+	for (size_t slot = 0; slot < PROF_SLOTS; slot++) {
+		void *ptr = __atomic_load_n(&prof_ptrs[slot], __ATOMIC_ACQUIRE);
+		if ((uintptr_t)ptr <= 2) continue;
+		sample_t sample = prof_samples[slot];
+		if (__atomic_load_n(&prof_ptrs[slot], __ATOMIC_ACQUIRE) != ptr || sample.depth > PROF_DEPTH) continue;
+		out_string(&out, "1: ");
+		out_number(&out, sample.size, 10);
+		out_string(&out, " [1: ");
+		out_number(&out, sample.size, 10);
+		out_string(&out, "] @");
+		for (size_t i = 0; i < sample.depth; i++) {
+			out_string(&out, " 0x");
+			out_number(&out, (uintptr_t)sample.stack[i], 16);
+		}
+		out_string(&out, "\n");
 	}
-	
-	pthread_mutex_unlock(&mutex);
-	return addr;
+
+	// pprof symbolizes the addresses with the mappings
+	out_string(&out, "\nMAPPED_LIBRARIES:\n");
+	out_flush(&out);
+	int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (maps >= 0) {
+		ssize_t n;
+		while ((n = read(maps, out.data, sizeof(out.data))) > 0) {
+			out.used = n;
+			out_flush(&out);
+		}
+		close(maps);
+	}
+	close(out.fd);
 }
 
-void *malloc(size_t size) {
-	void *addr = alloc(ALIGNMENT, size);
-#ifdef DEBUG
-	fprintf(stderr, "malloc(%d)", size);
-	fprintf(stderr, " = %p\n", addr);
-#endif
-	return addr;
+static void prof_signal(int signal) {
+	int saved = errno;
+	prof_dump();
+	errno = saved;
 }
 
+__attribute__((destructor)) static void prof_exit() {
+	if (conf.prof_rate) prof_dump();
+}
 
-void free(void *ptr) {
-#ifdef DEBUG
-	fprintf(stderr, "free(%p)\n", ptr);
-#endif
-	if (!ptr) return;
-	pthread_mutex_lock(&mutex);
+static void trace_open() {
+	if (out_open(&trace_out, "trace", -1) < 0) conf.trace = false;
+}
 
-	chunk_t *chunk = (chunk_t *)(ptr - sizeof(chunk_t));
-	chunk->free = 1;
-	
-	// Coalesce to the left
-	if (chunk->prev && chunk->prev->free) {
-		chunk->prev->size += chunk->size + sizeof(chunk_t);
-		chunk->prev->next = chunk->next;
-		chunk->next->prev = chunk->prev;
-		chunk = chunk->prev;
+// One line per call, the replay harness in bench/ reads them back:
+// "m size ptr", "c size ptr" for calloc(), "a alignment size ptr", "r old size new" and "f ptr".
+// Sizes are decimal, pointers hexadecimal.
+static void trace(char op, size_t a, size_t b, void *ptr) {
+	char line[2] = { op, '\0' };
+	lock_acquire(&trace_lock);
+	out_string(&trace_out, line);
+	if (op == 'a' || op == 'r') {
+		out_string(&trace_out, " ");
+		out_number(&trace_out, a, op == 'r' ? 16 : 10);
 	}
-	// Coalesce to the right
-	if (chunk->next->free) {
-		chunk->size += chunk->next->size + sizeof(chunk_t);
-		chunk->next = chunk->next->next;
-		chunk->next->prev = chunk;
+	if (op != 'f') {
+		out_string(&trace_out, " ");
+		out_number(&trace_out, op == 'a' || op == 'r' ? b : a, 10);
+	}
+	out_string(&trace_out, " ");
+	out_number(&trace_out, (uintptr_t)ptr, 16);
+	out_string(&trace_out, "\n");
+	lock_release(&trace_lock);
+}
+
+__attribute__((destructor)) static void trace_exit() {
+	if (!conf.trace) return;
+	lock_acquire(&trace_lock);
+	out_flush(&trace_out);
+	lock_release(&trace_lock);
+}
+
+// Never zero, so a chunk whose cookie was cleared on free() fails the check
+static size_t cookie(chunk_t *chunk) {
+	return (((uintptr_t)chunk ^ check_secret) * 0x9e3779b97f4a7c15ULL >> COOKIE_SHIFT) | 1;
+}
+
+// Slab objects have no header, neither do region blocks, whose large objects are left alone
+static void check_stamp(void *ptr) {
+	if (is_slab(ptr) || is_region(ptr)) return;
+	chunk_t *chunk = chunk_of(ptr);
+	if (!(chunk->head & REGION)) chunk->head = (chunk->head & ~(~0ULL << COOKIE_SHIFT)) | (uint64_t)cookie(chunk) << COOKIE_SHIFT;
+}
+
+static bool check_verify(void *ptr) {
+	if (is_slab(ptr) || is_region(ptr)) return true;
+	if ((uintptr_t)ptr & (ALIGNMENT - 1)) return false;
+	chunk_t *chunk = chunk_of(ptr);
+	return (chunk->head & REGION) || (chunk->head >> COOKIE_SHIFT) == cookie(chunk);
+}
+
+// Verify the chunk of a pointer being freed and clear its cookie, so that a second free() is caught
+static void check_free(void *ptr) {
+	if (!check_verify(ptr)) {
+		bool freed = !((uintptr_t)ptr & (ALIGNMENT - 1)) && (!(chunk_of(ptr)->head & INUSE) || !(chunk_of(ptr)->head >> COOKIE_SHIFT));
+		check_fail(freed ? "double free" : "free() of a bad pointer", ptr);
+	}
+	if (!is_slab(ptr)) chunk_of(ptr)->head &= ~(~0ULL << COOKIE_SHIFT);
+}
+
+// A cached object carries the secret in its second word.
+// Finding it there on free() means the object is most likely cached already, the list tells for sure.
+static void check_cached(void *ptr, size_t index) {
+	if (((uint64_t *)ptr)[1] == check_secret) {
+		for (void *entry = tcache.entries[index]; entry != NULL; entry = *(void **)entry) {
+			if (entry == ptr) check_fail("double free", ptr);
+		}
 	}
-	pthread_mutex_unlock(&mutex);
+	((uint64_t *)ptr)[1] = check_secret;
+}
+
+// Report without allocating and abort, the heap cannot be trusted any more
+static void check_fail(const char *what, void *ptr) {
+	out_t out = { .fd = STDERR_FILENO, .used = 0 };
+	out_string(&out, "qalloc: ");
+	out_string(&out, what);
+	out_string(&out, ": 0x");
+	out_number(&out, (uintptr_t)ptr, 16);
+	out_string(&out, "\n");
+	out_flush(&out);
+	abort();
 }
 
 void *calloc(size_t nmemb, size_t size) {
@@ -239,17 +2679,29 @@ void *calloc(size_t nmemb, size_t size) {
 #endif
 	void *addr;
 
-	if (size > SIZE_MAX / nmemb) return NULL;
+	if (nmemb && size > SIZE_MAX / nmemb) return NULL;
 	size *= nmemb;
-	addr = malloc(size);
-	if (addr) memset(addr, 0, size);
+	addr = alloc(ALIGNMENT, size, true);
 #ifdef DEBUG	
 	fprintf(stderr, " = %p\n", addr);
 #endif
 	return addr;
 }
 
+// The free() that realloc() makes when it moves the data checks the old chunk.
+// Resizing in place rewrites the head, so the cookie is set again either way.
 void *realloc(void *ptr, size_t size) {
+	if (!conf.trace && !conf.check) return reallocate(ptr, size);
+	if (conf.check && ptr && !check_verify(ptr)) check_fail("realloc() of a bad pointer", ptr);
+	trace_inner = true;
+	void *addr = reallocate(ptr, size);
+	trace_inner = false;
+	if (conf.check && addr) check_stamp(addr);
+	if (conf.trace) trace('r', (uintptr_t)ptr, size, addr);
+	return addr;
+}
+
+static void *reallocate(void *ptr, size_t size) {
 #ifdef DEBUG
 	fprintf(stderr, "realloc(%p, %d)", ptr, size);
 #endif
@@ -259,34 +2711,62 @@ void *realloc(void *ptr, size_t size) {
 		return NULL;
 	}
 
+	if (size > PTRDIFF_MAX) return NULL;
+
 	size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1); // Align the size to ALIGNMENT bytes
-	chunk_t *chunk = (chunk_t *)(ptr - sizeof(chunk_t));
-	ptrdiff_t delta = size - chunk->size;
+	if (is_slab(ptr)) {
+		// Moving to the smaller class keeps the class the size of the last request, free_sized() relies on that
+		size_t old = slab_of(ptr)->size;
+		if (size == old) return ptr;
+		void *addr = malloc(size);
+		if (addr) {
+			memcpy(addr, ptr, old < size ? old : size);
+			free(ptr);
+		}
+		return addr;
+	}
 
-	if (delta <= 0) {
-		pthread_mutex_lock(&mutex);
-		crop(chunk, size);
-		pthread_mutex_unlock(&mutex);
+	// Region and boot memory stay where they are, the data moves to the heap
+	if (is_region(ptr) || is_boot(ptr) || (chunk_of(ptr)->head & REGION)) {
+		size_t old = is_region(ptr) ? region_extent(ptr) : usable_size(ptr);
+		void *addr = malloc(size);
+		if (addr) memcpy(addr, ptr, old < size ? old : size);
+		return addr;
 	}
-	else {
-		pthread_mutex_lock(&mutex);
-		if (chunk->next->free && delta <= chunk->next->size + sizeof(chunk_t)) { // The next chunk is open for business
-			chunk->size += chunk->next->size + sizeof(chunk_t);
-			chunk->next = chunk->next->next;
-			chunk->next->prev = chunk;
-			crop(chunk, size);
-			pthread_mutex_unlock(&mutex);
-		}
-		else {
-			pthread_mutex_unlock(&mutex);
-			void *addr = malloc(size);
-			memcpy(addr, ptr, chunk->size);
+
+	// The guard page has to stay at the end, so the data moves to a new guarded chunk or to the heap
+	chunk_t *chunk = chunk_of(ptr);
+	if (is_guarded(chunk)) {
+		size_t old = usable_size(ptr);
+		void *addr = malloc(size);
+		if (addr) {
+			memcpy(addr, ptr, old < size ? old : size);
 			free(ptr);
-			ptr = addr;
 		}
+		return addr;
 	}
 
-	return ptr;
+	// A sample that moves with its data is dropped, as if it had been freed
+	if (chunk->head & MMAPPED) {
+		void *addr = remap_chunk(chunk, size);
+		if (addr && addr != ptr && conf.prof_rate) prof_forget(ptr);
+		return addr;
+	}
+
+	arena_t *arena = arena_of(chunk);
+	size_t old = chunk_size(chunk) - OVERHEAD;
+
+	arena_lock(arena);
+	void *addr = resize(arena, chunk, request_size(size));
+	arena_unlock(arena);
+	if (addr && addr != ptr && conf.prof_rate) prof_forget(ptr);
+	if (addr) return addr;
+
+	addr = malloc(size);
+	if (!addr) return NULL;
+	memcpy(addr, ptr, old < size ? old : size);
+	free(ptr);
+	return addr;
 }
 
 void *reallocarray(void *ptr, size_t nmemb, size_t size) {
@@ -295,7 +2775,7 @@ void *reallocarray(void *ptr, size_t nmemb, size_t size) {
 #endif
 	void *addr;
 
-	if (size > SIZE_MAX / nmemb) return NULL;
+	if (nmemb && size > SIZE_MAX / nmemb) return NULL;
 	size *= nmemb;
 	addr = realloc(ptr, size);
 #ifdef DEBUG	
@@ -306,17 +2786,17 @@ void *reallocarray(void *ptr, size_t nmemb, size_t size) {
 }
 
 size_t malloc_usable_size(void *ptr) {
-	chunk_t *chunk = (chunk_t *)(ptr - sizeof(chunk_t));
-	return chunk->size;
+	if (!ptr || is_region(ptr)) return 0; // Their size is not recorded
+	return usable_size(ptr);
 }
 
 void *aligned_alloc(size_t alignment, size_t size) {
 #ifdef DEBUG
 	fprintf(stderr, "aligned_alloc(%d, %d)", alignment, size);
 #endif
-	
-	void *addr;
-	posix_memalign(&addr, alignment, size);
+	void *addr = NULL;
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) errno = EINVAL; // Check whether alignment is a power of 2
+	else addr = alloc(alignment, size, false);
 
 #ifdef DEBUG
 	fprintf(stderr, " = %p\n", addr);
@@ -325,19 +2805,389 @@ void *aligned_alloc(size_t alignment, size_t size) {
 }
 
 int posix_memalign(void **memptr, size_t alignment, size_t size) {
-	void *addr;
-	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
-		return EINVAL;
-	} // Check whethere alignment is a power of 2 or 0
-	else if (alignment > pagesize) {
-		fprintf(stderr, "Alignment larger than pagesize is not supported!\n");
-		exit(EXIT_FAILURE);
+	// Alignment has to be a power of 2 and a multiple of the size of a pointer
+	if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) return EINVAL;
+	void *addr = alloc(alignment, size, false);
+	if (!addr) return ENOMEM;
+	*memptr = addr;
+	return 0;
+}
+
+// Like glibc, round an alignment that is not a power of 2 up to the next one
+void *memalign(size_t alignment, size_t size) {
+	if (alignment > PTRDIFF_MAX) {
+		errno = EINVAL;
+		return NULL;
 	}
-	else {
-		addr = alloc(alignment, size);
-		if (errno == ENOMEM) return ENOMEM;
-		*memptr = addr;
+	if (alignment & (alignment - 1)) alignment = 1UL << (64 - __builtin_clzll(alignment));
+	return alloc(alignment, size, false);
+}
+
+void *valloc(size_t size) {
+	pthread_once(&init_once, init);
+	return alloc(pagesize, size, false);
+}
+
+// Allocate whole pages
+void *pvalloc(size_t size) {
+	pthread_once(&init_once, init);
+	if (size > PTRDIFF_MAX) return NULL;
+	return alloc(pagesize, (size + pagesize - 1) & ~(pagesize - 1), false);
+}
+
+int mallopt(int param, int value) {
+	switch (param) {
+	case M_MMAP_THRESHOLD:
+		if (value < 0) return 0;
+		conf.mmap_threshold = value;
+		return 1;
+	case M_TRIM_THRESHOLD:
+		if (value < 0) return 0;
+		conf.trim_threshold = value;
+		trim_dynamic = false;
+		return 1;
+	case M_TOP_PAD:
+		if (value < 0) return 0;
+		conf.top_pad = value;
+		trim_dynamic = false;
+		return 1;
+	default:
 		return 0;
 	}
 }
 
+// Trim the top of every heap down to pad bytes, unmap segments that have emptied
+// and drop the pages inside free chunks and empty slabs.
+// Thread caches are emptied, those of other threads on their next operation.
+int malloc_trim(size_t pad) {
+	bool released = false;
+	tcache_scavenge(false);
+	if (tcache.state == TCACHE_ACTIVE) tcache_gc(); // The caller's own cache is flushed right away
+	for (size_t i = 0; i < narenas; i++) {
+		arena_t *arena = &arenas[i];
+		arena_lock(arena);
+		remote_drain(arena);
+		consolidate(arena);
+		released |= trim_top(arena, pad);
+		arena->trimmed = 0; // Asked for, growing again afterwards says nothing about the threshold
+		released |= segments_unmap(arena);
+		for (size_t index = next_bin(arena, 0); index < NBINS; index = next_bin(arena, index + 1)) {
+			for (chunk_t *chunk = arena->bins[index]; chunk != NULL; chunk = links(chunk)->fd) released |= purge_chunk(chunk);
+		}
+		arena_unlock(arena);
+	}
+	released |= slab_purge();
+	released |= region_purge();
+	return released;
+}
+
+// Only one caller gets to create the thread, the allocations pthread_create() makes find nothing pending.
+// The thread takes no signals, the process' handlers expect to run in its own threads.
+static void background_start() {
+	if (!__atomic_exchange_n(&background_pending, false, __ATOMIC_ACQ_REL)) return;
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_t thread;
+	if (pthread_create(&thread, &attr, background_main, NULL) == 0) background_running = true; // Otherwise trimming stays inline
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void *background_main(void *arg) {
+	struct timespec interval = { .tv_sec = conf.background / 1000, .tv_nsec = conf.background % 1000 * 1000000 };
+	for (;;) {
+		nanosleep(&interval, NULL);
+		background_pass();
+	}
+	return arg;
+}
+
+// Whether a chunk of a log-spaced bin has been free since before the last pass, with its pages still there
+static bool is_stale(chunk_t *chunk) {
+	size_t binned = tree(chunk)->binned;
+	return binned && binned + 1 < __atomic_load_n(&background_passes, __ATOMIC_RELAXED);
+}
+
+// What malloc_trim() does, for the memory that stayed free for a whole interval.
+// Every arena is locked once for its own work and then once per bin, so no allocation waits for long.
+// Thread caches that went unused for an interval are emptied by their threads on their next operation.
+static void background_pass() {
+	__atomic_add_fetch(&background_passes, 1, __ATOMIC_RELAXED);
+	tcache_scavenge(true);
+	for (size_t i = 0; i < narenas; i++) {
+		arena_t *arena = &arenas[i];
+		arena_lock(arena);
+		remote_drain(arena);
+		consolidate(arena);
+		chunk_t *last_chunk = arena->last_chunk;
+		if (last_chunk && !(last_chunk->head & PREV_INUSE)) {
+			chunk_t *top = prev_chunk(last_chunk);
+			if (chunk_size(top) >= conf.trim_threshold && chunk_size(top) > MAX_SMALL && is_stale(top)) trim_top(arena, conf.top_pad);
+		}
+		segments_unmap(arena);
+		arena_unlock(arena);
+
+		for (size_t index = NSMALLBINS; index < NBINS; index++) {
+			if (!__atomic_load_n(&arena->bins[index], __ATOMIC_RELAXED)) continue; // A racy look, the next pass sees what it missed
+			arena_lock(arena);
+			for (chunk_t *chunk = arena->bins[index]; chunk != NULL; chunk = links(chunk)->fd) {
+				if (!is_stale(chunk)) continue;
+				purge_chunk(chunk);
+				tree(chunk)->binned = 0;
+			}
+			arena_unlock(arena);
+		}
+	}
+	slab_purge();
+	region_purge();
+}
+
+// Copy the counters of the arena, so that they can be printed without holding its lock
+static void stats_read(arena_t *arena, stats_t *stats) {
+	arena_lock(arena);
+	remote_drain(arena); // Otherwise what other threads freed would still count as in use
+	*stats = arena->stats;
+	arena_unlock(arena);
+}
+
+// Add up the counters of every thread cache, live or retired, and what the live ones may hold by class
+static void thread_stats(size_t *hits, size_t *puts, size_t *limits) {
+	lock_acquire(&stats_lock);
+	memcpy(hits, retired_hits, sizeof(retired_hits));
+	*puts = retired_puts;
+	memset(limits, 0, NSMALLBINS * sizeof(size_t));
+	for (tcache_t *tc = tcaches; tc != NULL; tc = tc->next) {
+		for (size_t index = 0; index < NSMALLBINS; index++) {
+			hits[index] += __atomic_load_n(&tc->hits[index], __ATOMIC_RELAXED);
+			limits[index] += __atomic_load_n(&tc->limits[index], __ATOMIC_RELAXED);
+		}
+		*puts += __atomic_load_n(&tc->puts, __ATOMIC_RELAXED);
+	}
+	lock_release(&stats_lock);
+}
+
+// Count the free chunks and their bytes in every bin by walking them
+static void free_sizes(arena_t *arena, size_t *counts, size_t *totals) {
+	arena_lock(arena);
+	for (size_t index = 0; index < NBINS; index++) {
+		counts[index] = totals[index] = 0;
+		for (chunk_t *chunk = arena->bins[index]; chunk != NULL; chunk = links(chunk)->fd) {
+			counts[index]++;
+			totals[index] += chunk_size(chunk);
+		}
+	}
+	arena_unlock(arena);
+}
+
+struct mallinfo2 mallinfo2(void) {
+	struct mallinfo2 info = { 0 };
+	pthread_once(&init_once, init);
+	for (size_t i = 0; i < narenas; i++) {
+		stats_t stats;
+		stats_read(&arenas[i], &stats);
+		info.arena += stats.system + stats.slab_pages;
+		info.ordblks += stats.nchunks;
+		info.uordblks += stats.system - stats.free + stats.slab_used;
+		info.fordblks += stats.free + stats.slab_pages - stats.slab_used;
+	}
+	info.hblks = __atomic_load_n(&mapped_count, __ATOMIC_RELAXED);
+	info.hblkhd = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+
+	// What malloc_trim() could give back from the main heap
+	arena_t *arena = &arenas[0];
+	arena_lock(arena);
+	if (arena->last_chunk && !(arena->last_chunk->head & PREV_INUSE)) info.keepcost = chunk_size(prev_chunk(arena->last_chunk));
+	arena_unlock(arena);
+	return info;
+}
+
+// The old interface, with every field cut down to an int
+struct mallinfo mallinfo(void) {
+	struct mallinfo2 info2 = mallinfo2();
+	struct mallinfo info = {
+		.arena = info2.arena,
+		.ordblks = info2.ordblks,
+		.smblks = info2.smblks,
+		.hblks = info2.hblks,
+		.hblkhd = info2.hblkhd,
+		.usmblks = info2.usmblks,
+		.fsmblks = info2.fsmblks,
+		.uordblks = info2.uordblks,
+		.fordblks = info2.fordblks,
+		.keepcost = info2.keepcost,
+	};
+	return info;
+}
+
+// Print the state of every arena to stderr, in the format of glibc followed by our own counters
+void malloc_stats(void) {
+	pthread_once(&init_once, init);
+	size_t system = 0, in_use = 0;
+	size_t node_system[MAX_NODES] = { 0 }, node_in_use[MAX_NODES] = { 0 };
+	for (size_t i = 0; i < narenas; i++) {
+		stats_t stats;
+		stats_read(&arenas[i], &stats);
+		if (!stats.system && !stats.slab_pages) continue; // Never used
+		node_system[arenas[i].node] += stats.system + stats.slab_pages;
+		node_in_use[arenas[i].node] += stats.system - stats.free + stats.slab_used;
+
+		size_t mallocs = 0;
+		for (size_t index = 0; index < NBINS; index++) mallocs += stats.mallocs[index];
+		fprintf(stderr, "Arena %zu:\n", i);
+		fprintf(stderr, "system bytes     = %10zu\n", stats.system + stats.slab_pages);
+		fprintf(stderr, "in use bytes     = %10zu\n", stats.system - stats.free + stats.slab_used);
+		fprintf(stderr, "free chunks      = %10zu\n", stats.nchunks);
+		if (conf.defer) fprintf(stderr, "deferred bytes   = %10zu\n", stats.deferred);
+		fprintf(stderr, "slab bytes       = %10zu\n", stats.slab_pages);
+		fprintf(stderr, "mallocs          = %10zu\n", mallocs);
+		fprintf(stderr, "frees            = %10zu\n", stats.frees);
+		fprintf(stderr, "remote frees     = %10zu\n", stats.remote);
+		fprintf(stderr, "lock contention  = %10zu\n", stats.contended);
+		fprintf(stderr, "extends          = %10zu\n", stats.extends);
+		fprintf(stderr, "trims            = %10zu\n", stats.trims);
+		system += stats.system + stats.slab_pages;
+		in_use += stats.system - stats.free + stats.slab_used;
+	}
+	for (unsigned node = 0; numa_nodes > 1 && node < numa_nodes; node++) {
+		fprintf(stderr, "Node %u:\n", node);
+		fprintf(stderr, "system bytes     = %10zu\n", node_system[node]);
+		fprintf(stderr, "in use bytes     = %10zu\n", node_in_use[node]);
+	}
+
+	size_t hits[NSMALLBINS], puts, limits[NSMALLBINS], total_hits = 0, total_limit = 0;
+	thread_stats(hits, &puts, limits);
+	for (size_t index = 0; index < NSMALLBINS; index++) {
+		total_hits += hits[index];
+		total_limit += limits[index];
+	}
+	size_t mapped = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+	fprintf(stderr, "Total (incl. mmap):\n");
+	fprintf(stderr, "system bytes     = %10zu\n", system + mapped);
+	fprintf(stderr, "in use bytes     = %10zu\n", in_use + mapped);
+	fprintf(stderr, "max mmap regions = %10zu\n", __atomic_load_n(&mapped_max_count, __ATOMIC_RELAXED));
+	fprintf(stderr, "max mmap bytes   = %10zu\n", __atomic_load_n(&mapped_max, __ATOMIC_RELAXED));
+	fprintf(stderr, "mmap allocations = %10zu\n", __atomic_load_n(&mapped_allocs, __ATOMIC_RELAXED));
+	fprintf(stderr, "tcache hits      = %10zu\n", total_hits);
+	fprintf(stderr, "tcache frees     = %10zu\n", puts);
+	fprintf(stderr, "tcache capacity  = %10zu\n", total_limit);
+	if (background_running) fprintf(stderr, "background passes= %10zu\n", __atomic_load_n(&background_passes, __ATOMIC_RELAXED) - 1);
+}
+
+// Write the state of every arena to fp, options 0 gives the XML of glibc and 1 the same as JSON.
+// Next to the free chunks by size, each heap lists its allocations by size class and its counters.
+int malloc_info(int options, FILE *fp) {
+	if (options != 0 && options != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	bool json = options == 1;
+	pthread_once(&init_once, init);
+
+	size_t total_count = 0, total_size = 0, total_system = 0, total_max = 0;
+	size_t counts[NBINS], totals[NBINS];
+	fprintf(fp, json ? "{\"version\": 1, \"heaps\": [" : "<malloc version=\"1\">\n");
+	for (size_t i = 0; i < narenas; i++) {
+		stats_t stats;
+		stats_read(&arenas[i], &stats);
+		free_sizes(&arenas[i], counts, totals);
+
+		if (json) fprintf(fp, "%s\n{\"nr\": %zu, \"node\": %u, \"sizes\": [", i ? "," : "", i, arenas[i].node);
+		else if (numa_nodes > 1) fprintf(fp, "<heap nr=\"%zu\" node=\"%u\">\n<sizes>\n", i, arenas[i].node);
+		else fprintf(fp, "<heap nr=\"%zu\">\n<sizes>\n", i);
+		bool first = true;
+		for (size_t index = 0; index < NBINS; index++) {
+			if (!counts[index]) continue;
+			size_t to = index + 1 < NBINS ? bin_size(index + 1) - 1 : SIZE_MAX;
+			if (json) fprintf(fp, "%s{\"from\": %zu, \"to\": %zu, \"total\": %zu, \"count\": %zu}", first ? "" : ", ", bin_size(index), to, totals[index], counts[index]);
+			else fprintf(fp, "  <size from=\"%zu\" to=\"%zu\" total=\"%zu\" count=\"%zu\"/>\n", bin_size(index), to, totals[index], counts[index]);
+			first = false;
+		}
+		if (json) fprintf(fp, "], \"mallocs\": [");
+		else fprintf(fp, "</sizes>\n<mallocs>\n");
+		first = true;
+		for (size_t index = 0; index < NBINS; index++) {
+			if (!stats.mallocs[index]) continue;
+			size_t to = index + 1 < NBINS ? bin_size(index + 1) - 1 : SIZE_MAX;
+			if (json) fprintf(fp, "%s{\"from\": %zu, \"to\": %zu, \"count\": %zu}", first ? "" : ", ", bin_size(index), to, stats.mallocs[index]);
+			else fprintf(fp, "  <size from=\"%zu\" to=\"%zu\" count=\"%zu\"/>\n", bin_size(index), to, stats.mallocs[index]);
+			first = false;
+		}
+		if (json) {
+			fprintf(fp, "], \"rest\": {\"count\": %zu, \"size\": %zu}, ", stats.nchunks, stats.free);
+			fprintf(fp, "\"system\": {\"current\": %zu, \"max\": %zu}, \"slab\": {\"size\": %zu, \"used\": %zu}, ", stats.system, stats.system_max, stats.slab_pages, stats.slab_used);
+			fprintf(fp, "\"frees\": %zu, \"remote\": %zu, \"contended\": %zu, \"extends\": %zu, \"trims\": %zu}", stats.frees, stats.remote, stats.contended, stats.extends, stats.trims);
+		}
+		else {
+			fprintf(fp, "</mallocs>\n");
+			fprintf(fp, "<total type=\"fast\" count=\"0\" size=\"0\"/>\n");
+			fprintf(fp, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", stats.nchunks, stats.free);
+			fprintf(fp, "<total type=\"slab\" count=\"%zu\" size=\"%zu\"/>\n", stats.slab_pages / pagesize, stats.slab_used);
+			fprintf(fp, "<system type=\"current\" size=\"%zu\"/>\n", stats.system);
+			fprintf(fp, "<system type=\"max\" size=\"%zu\"/>\n", stats.system_max);
+			fprintf(fp, "<count type=\"frees\" value=\"%zu\"/>\n", stats.frees);
+			fprintf(fp, "<count type=\"remote\" value=\"%zu\"/>\n", stats.remote);
+			fprintf(fp, "<count type=\"contended\" value=\"%zu\"/>\n", stats.contended);
+			fprintf(fp, "<count type=\"extends\" value=\"%zu\"/>\n", stats.extends);
+			fprintf(fp, "<count type=\"trims\" value=\"%zu\"/>\n", stats.trims);
+			fprintf(fp, "</heap>\n");
+		}
+		total_count += stats.nchunks;
+		total_size += stats.free;
+		total_system += stats.system + stats.slab_pages;
+		total_max += stats.system_max;
+	}
+
+	size_t hits[NSMALLBINS], puts, limits[NSMALLBINS];
+	thread_stats(hits, &puts, limits);
+	size_t mapped_n = __atomic_load_n(&mapped_count, __ATOMIC_RELAXED), mapped = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+	if (json) {
+		fprintf(fp, "\n], \"tcache\": {\"frees\": %zu, \"hits\": [", puts);
+		bool first = true;
+		for (size_t index = 0; index < NSMALLBINS; index++) {
+			if (!hits[index]) continue;
+			fprintf(fp, "%s{\"from\": %zu, \"to\": %zu, \"count\": %zu, \"capacity\": %zu}", first ? "" : ", ", bin_size(index), bin_size(index + 1) - 1, hits[index], limits[index]);
+			first = false;
+		}
+		fprintf(fp, "]}, \"rest\": {\"count\": %zu, \"size\": %zu}, ", total_count, total_size);
+		fprintf(fp, "\"mmap\": {\"count\": %zu, \"size\": %zu, \"max\": %zu, \"allocs\": %zu}, ", mapped_n, mapped, __atomic_load_n(&mapped_max, __ATOMIC_RELAXED), __atomic_load_n(&mapped_allocs, __ATOMIC_RELAXED));
+		fprintf(fp, "\"system\": {\"current\": %zu, \"max\": %zu}}\n", total_system, total_max);
+	}
+	else {
+		fprintf(fp, "<tcache>\n");
+		for (size_t index = 0; index < NSMALLBINS; index++) {
+			if (hits[index]) fprintf(fp, "  <size from=\"%zu\" to=\"%zu\" count=\"%zu\" capacity=\"%zu\"/>\n", bin_size(index), bin_size(index + 1) - 1, hits[index], limits[index]);
+		}
+		fprintf(fp, "</tcache>\n");
+		fprintf(fp, "<total type=\"fast\" count=\"0\" size=\"0\"/>\n");
+		fprintf(fp, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", total_count, total_size);
+		fprintf(fp, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n", mapped_n, mapped);
+		fprintf(fp, "<system type=\"current\" size=\"%zu\"/>\n", total_system);
+		fprintf(fp, "<system type=\"max\" size=\"%zu\"/>\n", total_max);
+		fprintf(fp, "<count type=\"tcache_frees\" value=\"%zu\"/>\n", puts);
+		fprintf(fp, "</malloc>\n");
+	}
+	return 0;
+}
+
+#ifdef QALLOC_CXX
+#pragma GCC visibility push(default)
+// operator delete of C++, in the plain, sized, aligned and nothrow flavours.
+// The matching operator new of libstdc++ allocates with malloc() already.
+void _ZdlPv(void *ptr) { free(ptr); }
+void _ZdaPv(void *ptr) { free(ptr); }
+void _ZdlPvm(void *ptr, size_t size) { free_sized(ptr, size); }
+void _ZdaPvm(void *ptr, size_t size) { free_sized(ptr, size); }
+void _ZdlPvSt11align_val_t(void *ptr, size_t alignment) { free(ptr); }
+void _ZdaPvSt11align_val_t(void *ptr, size_t alignment) { free(ptr); }
+void _ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t alignment) { free_aligned_sized(ptr, alignment, size); }
+void _ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t alignment) { free_aligned_sized(ptr, alignment, size); }
+void _ZdlPvRKSt9nothrow_t(void *ptr, const void *nothrow) { free(ptr); }
+void _ZdaPvRKSt9nothrow_t(void *ptr, const void *nothrow) { free(ptr); }
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t alignment, const void *nothrow) { free(ptr); }
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t alignment, const void *nothrow) { free(ptr); }
+#pragma GCC visibility pop
+#endif
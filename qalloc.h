@@ -0,0 +1,31 @@
+#ifndef QALLOC_H
+#define QALLOC_H
+
+#include <stddef.h>
+
+// Extensions of qalloc beyond the glibc malloc interface
+
+// Allocate n objects of size bytes each into out, taking the arena lock once.
+// Returns how many were allocated, fewer than n only when memory runs out.
+// Each object is traced, profiled and checked like one from malloc(), with guard:<n> they are allocated one by one.
+size_t qalloc_batch_malloc(size_t size, size_t n, void **out);
+
+// Free n pointers, NULL entries are skipped.
+// Neighbouring chunks are merged before they are freed, so the order of ptrs is not kept.
+void qalloc_batch_free(void **ptrs, size_t n);
+
+// A region allocates by bumping a pointer and frees everything at once on reset or destroy.
+// It is not locked, use it from one thread at a time. Its objects are aligned like malloc()'s.
+// free() leaves their objects alone, realloc() copies them to the heap.
+typedef struct qalloc_region_t qalloc_region_t;
+
+qalloc_region_t *qalloc_region_create(void);
+void *qalloc_region_alloc(qalloc_region_t *region, size_t size);
+void qalloc_region_reset(qalloc_region_t *region);
+void qalloc_region_destroy(qalloc_region_t *region);
+
+// C23 sized deallocation, size and alignment are those the memory was requested with
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+
+#endif